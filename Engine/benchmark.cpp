@@ -21,13 +21,22 @@
 ////
 //// Includes
 ////
+#if !defined(_MSC_VER)
+#  include <unistd.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <vector>
 
 #include "benchmark.h"
+#include "evaluate.h"
+#include "san.h"
 #include "search.h"
 #include "thread.h"
+#include "tt.h"
 #include "ucioption.h"
 
 using namespace std;
@@ -56,6 +65,52 @@ const string BenchmarkPositions[] = {
 };
 
 
+////
+//// Local definitions
+////
+
+namespace {
+
+  // Number of distinct keys and of clusters used by the transposition table
+  // stress test. Many keys share the same few clusters so that threads are
+  // continuously overwriting each other's entries.
+  const int StressKeys = 4096;
+  const int StressClusters = 256;
+
+  // Per thread results of the stress test, padded to avoid false sharing
+  struct StressCounters {
+    int64_t probes, hits, inconsistent;
+    unsigned char pad[64];
+  };
+
+  volatile bool StressStop;
+  StressCounters StressResults[MAX_THREADS];
+
+  void tt_stress_test(int threads, int seconds);
+
+  // Positions of a batch analysis and their results. Results are written
+  // in input order, so a finished job waits until all the previous ones
+  // have been written.
+  struct AnalysisJob {
+    string fen, ops, result;
+    bool done;
+  };
+
+  vector<AnalysisJob> AnalysisJobs;
+  int NextToSearch, NextToWrite, AnalysisDepth, AnalysisHash;
+  ofstream AnalysisFile;
+  Lock AnalysisLock;
+
+  void parse_epd(const string& line, AnalysisJob& job);
+
+#if !defined(_MSC_VER)
+  void* analysis_thread(void*);
+#else
+  DWORD WINAPI analysis_thread(LPVOID);
+#endif
+}
+
+
 ////
 //// Functions
 ////
@@ -66,7 +121,9 @@ const string BenchmarkPositions[] = {
 /// be used, the time in seconds spent for each position (optional, default
 /// is 60) and an optional file name where to look for positions in fen
 /// format (default are the BenchmarkPositions defined above).
-/// The analysis is written to a file named bench.txt.
+/// The analysis is written to a file named bench.txt. With the "overshoot"
+/// limit the time is in milliseconds, as for "go movetime", and how much
+/// longer than that the searches lasted is reported.
 
 void benchmark(const string& commandLine) {
 
@@ -102,9 +159,18 @@ void benchmark(const string& commandLine) {
 
   secsPerPos = maxDepth = maxNodes = 0;
 
+  if (limitType == "ttstress")
+  {
+      TT.set_size(get_option_value_int("Hash"));
+      tt_stress_test(get_option_value_int("Threads"), val);
+      return;
+  }
+
   if (limitType == "time")
       secsPerPos = val * 1000;
-  else if (limitType == "depth" || limitType == "perft")
+  else if (limitType == "overshoot")
+      secsPerPos = val; // In milliseconds, as "go movetime"
+  else if (limitType == "depth" || limitType == "perft" || limitType == "divide" || limitType == "split")
       maxDepth = val;
   else
       maxNodes = val;
@@ -144,8 +210,16 @@ void benchmark(const string& commandLine) {
 
   vector<string>::iterator it;
   int cnt = 1;
-  int64_t totalNodes = 0;
+  int64_t totalNodes = 0, splitJoins = 0, splitJoinTime = 0;
+  int overshootSum = 0, overshootMax = 0;
+  int64_t threadNodes[MAX_THREADS] = {}, threadLateJoins[MAX_THREADS] = {}, threadIdleTime[MAX_THREADS] = {};
+  int threadsCnt = get_option_value_int("Threads");
+  TTStats ttStats;
+  memset(&ttStats, 0, sizeof(TTStats));
+  uint64_t evalProbes, evalHits, lazyExits, startEvalProbes, startEvalHits, startLazyExits;
+  eval_cache_stats(startEvalProbes, startEvalHits, startLazyExits);
   int startTime = get_system_time();
+  int startCpuTime = get_cpu_time();
 
   for (it = positions.begin(); it != positions.end(); ++it, ++cnt)
   {
@@ -153,24 +227,90 @@ void benchmark(const string& commandLine) {
       int dummy[2] = {0, 0};
       Position pos(*it, 0);
       cerr << "\nBench position: " << cnt << '/' << positions.size() << endl << endl;
-      if (limitType == "perft")
+      if (limitType == "perft" || limitType == "divide")
       {
-          int64_t perftCnt = perft(pos, maxDepth * OnePly);
+          int64_t perftCnt = perft(pos, maxDepth * OnePly, limitType == "divide");
           cerr << "\nPerft " << maxDepth << " result (nodes searched): " << perftCnt << endl << endl;
           totalNodes += perftCnt;
       } else {
+          int searchStart = get_monotonic_time();
+
           if (!think(pos, false, false, 0, dummy, dummy, 0, maxDepth, maxNodes, secsPerPos, moves))
               break;
+
+          // How much later than requested the search has stopped
+          int overshoot = get_monotonic_time() - searchStart - secsPerPos;
+          overshootSum += overshoot;
+          overshootMax = Max(overshootMax, overshoot);
           totalNodes += nodes_searched();
+
+          int64_t joins, joinTime;
+          split_latency(joins, joinTime);
+          splitJoins += joins;
+          splitJoinTime += joinTime;
+
+          for (int i = 0; i < threadsCnt; i++)
+          {
+              int64_t nodes, lateJoins, idleTime;
+              thread_stats(i, nodes, lateJoins, idleTime);
+              threadNodes[i] += nodes;
+              threadLateJoins[i] += lateJoins;
+              threadIdleTime[i] += idleTime;
+          }
+
+          // Counters are reset at each new search, so sum them here
+          TTStats st = TT.get_stats();
+          ttStats.probes         += st.probes;
+          ttStats.hits           += st.hits;
+          ttStats.unusable       += st.unusable;
+          ttStats.stores         += st.stores;
+          ttStats.sameKey        += st.sameKey;
+          ttStats.genEvictions   += st.genEvictions;
+          ttStats.depthEvictions += st.depthEvictions;
       }
   }
 
   cnt = get_system_time() - startTime;
+  eval_cache_stats(evalProbes, evalHits, lazyExits);
+  evalProbes -= startEvalProbes;
+  evalHits -= startEvalHits;
+  lazyExits -= startLazyExits;
   cerr << "==============================="
        << "\nTotal time (ms) : " << cnt
        << "\nNodes searched  : " << totalNodes
        << "\nNodes/second    : " << (int)(totalNodes/(cnt/1000.0)) << endl << endl;
 
+  if (limitType == "split")
+      cerr << "Split joins     : " << splitJoins
+           << "\nJoin latency us : " << (splitJoins ? double(splitJoinTime) / splitJoins : 0.0)
+           << "\nCPU time (ms)   : " << get_cpu_time() - startCpuTime
+           << "\nCPU usage (%)   : " << 100 * (get_cpu_time() - startCpuTime) / Max(cnt, 1) << endl << endl;
+
+  if (limitType == "overshoot")
+      cerr << "Move time (ms)  : " << secsPerPos
+           << "\nOvershoot avg   : " << overshootSum / int(positions.size())
+           << "\nOvershoot max   : " << overshootMax << endl << endl;
+
+  for (int i = 0; limitType == "split" && i < threadsCnt; i++)
+      cerr << "Thread " << i
+           << " nodes " << threadNodes[i]
+           << " late joins " << threadLateJoins[i]
+           << " idle (ms) " << threadIdleTime[i] / 1000 << endl;
+
+  if (limitType != "perft" && limitType != "divide")
+      cerr << "Hash probes     : " << ttStats.probes
+           << "\nHash hits       : " << ttStats.hits
+           << " (" << (ttStats.probes ? 100 * ttStats.hits / ttStats.probes : 0) << "%)"
+           << "\nHash unusable   : " << ttStats.unusable
+           << "\nHash stores     : " << ttStats.stores
+           << "\nSame key stores : " << ttStats.sameKey
+           << "\nOld evictions   : " << ttStats.genEvictions
+           << "\nDepth evictions : " << ttStats.depthEvictions << endl << endl
+           << "Eval probes     : " << evalProbes
+           << "\nEval cache hits : " << evalHits
+           << " (" << (evalProbes ? 100 * evalHits / evalProbes : 0) << "%)"
+           << "\nLazy eval exits : " << lazyExits << endl << endl;
+
   if (!timFile.empty())
   {
       timingFile << cnt << endl << endl;
@@ -184,3 +324,373 @@ void benchmark(const string& commandLine) {
   cin >> fileName;
   #endif
 }
+
+
+/// analyse_positions() searches all the positions of an EPD or fen file to
+/// a fixed depth and writes the results to another file, in EPD format and
+/// in the order of the input file. Positions are searched concurrently by
+/// the given number of workers, each one running a single threaded search
+/// with its own slice of the "Hash" size as transposition table. The table
+/// of a worker is cleared before each position, so that the results don't
+/// depend on the number of workers. Returns false if nothing was written.
+
+bool analyse_positions(const string& inputFile, const string& outputFile, int depth, int workers) {
+
+#if !defined(_MSC_VER)
+  pthread_t handles[MAX_THREADS];
+#else
+  HANDLE handles[MAX_THREADS];
+#endif
+
+  ifstream epdFile(inputFile.c_str());
+  if (!epdFile.is_open())
+  {
+      cerr << "Unable to open positions file " << inputFile << endl;
+      return false;
+  }
+
+  AnalysisJobs.clear();
+  string line;
+  while (getline(epdFile, line))
+      if (line.find_first_not_of(" \t\r") != string::npos)
+      {
+          AnalysisJob job;
+          parse_epd(line, job);
+          AnalysisJobs.push_back(job);
+      }
+
+  epdFile.close();
+
+  // Each worker books a search thread, so don't ask for more than are left.
+  // The threads of the default search context, "Threads" of them, are taken.
+  int freeThreads = available_threads();
+  if (!freeThreads)
+  {
+      cerr << "No free thread to analyse positions, lower \"Threads\" and retry" << endl;
+      return false;
+  }
+
+  workers = Min(Min(workers, freeThreads), int(AnalysisJobs.size()));
+  workers = Max(workers, 1);
+
+  AnalysisFile.open(outputFile.c_str(), ios::out | ios::trunc);
+  if (!AnalysisFile.is_open())
+  {
+      cerr << "Unable to open output file " << outputFile << endl;
+      return false;
+  }
+
+  NextToSearch = NextToWrite = 0;
+  AnalysisDepth = Max(depth, 1);
+  AnalysisHash = Max(get_option_value_int("Hash") / workers, 1);
+  lock_init(&AnalysisLock, NULL);
+
+  int startTime = get_system_time();
+
+  for (int i = 0; i < workers; i++)
+  {
+#if !defined(_MSC_VER)
+      bool ok = (pthread_create(&handles[i], NULL, analysis_thread, NULL) == 0);
+#else
+      bool ok = ((handles[i] = CreateThread(NULL, 0, analysis_thread, NULL, 0, NULL)) != NULL);
+#endif
+      if (!ok)
+      {
+          cerr << "Failed to create thread number " << i << endl;
+          Application::exit_with_failure();
+      }
+  }
+
+  for (int i = 0; i < workers; i++)
+  {
+#if !defined(_MSC_VER)
+      pthread_join(handles[i], NULL);
+#else
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+#endif
+  }
+
+  lock_destroy(&AnalysisLock);
+  AnalysisFile.close();
+
+  cerr << "Analysed " << AnalysisJobs.size() << " positions to depth " << AnalysisDepth
+       << " with " << workers << " workers in " << get_system_time() - startTime
+       << " ms" << endl;
+
+  return true;
+}
+
+
+namespace {
+
+  // stress_key() returns the i-th key of the stress test. The high 16 bits,
+  // stored in the entry, are unique and the next 16 are random. The low 32
+  // bits are the fraction of the table first_entry() multiplies by the
+  // number of clusters: only their high bits are set, to one of the
+  // StressClusters evenly spaced fractions, so that the keys fall in
+  // StressClusters distinct clusters whatever the table size, as long as
+  // it has at least StressClusters clusters.
+
+  Key stress_key(int i) {
+
+    Key mix = (Key(i + 1) * 0x9E3779B97F4A7C15ULL) & 0x0000FFFF00000000ULL;
+    Key fraction = (Key(i % StressClusters) << 32) / StressClusters;
+    return (Key(i + 1) << 48) | mix | fraction;
+  }
+
+  // The payload of an entry is a function of its key, so that a reader can
+  // always verify that what it got back belongs to the key it asked for.
+
+  Value stress_value(Key k) { return Value(int((k >> 32) & 0x3FFF) - 0x2000); }
+  Depth stress_depth(Key k) { return Depth((k >> 46) & 0x3F); }
+  Move stress_move(Key k) { return Move(((k >> 40) & 0x1FFFF) | 1); }
+  ValueType stress_type(Key k) { return ValueType(1 + (k >> 60) % 3); }
+
+
+  // stress_loop() is run by each thread of the stress test. Every thread
+  // stores and retrieves random keys of the shared key set until the test
+  // is stopped, counting the retrieved entries that don't match their key.
+
+  void stress_loop(int threadID) {
+
+    StressCounters& c = StressResults[threadID];
+    uint64_t rnd = 0x2545F4914F6CDD1DULL * (threadID + 1);
+    TTEntry snapshot;
+
+    while (!StressStop)
+    {
+        rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17; // xorshift64
+        Key k = stress_key(int(rnd % StressKeys));
+
+        if (rnd >> 63)
+        {
+            Value v = stress_value(k);
+            TT.store(k, v, stress_type(k), stress_depth(k), stress_move(k), Value(-v), Value(v / 2), threadID);
+            continue;
+        }
+
+        const TTEntry* tte = TT.retrieve(k, snapshot, threadID);
+        c.probes++;
+
+        if (!tte)
+            continue;
+
+        c.hits++;
+
+        if (   tte->value() != stress_value(k)
+            || tte->depth() != stress_depth(k)
+            || tte->move() != stress_move(k)
+            || tte->type() != stress_type(k)
+            || tte->static_value() != Value(-stress_value(k))
+            || tte->king_danger() != Value(stress_value(k) / 2))
+            c.inconsistent++;
+    }
+  }
+
+#if !defined(_MSC_VER)
+
+  void* stress_thread(void* threadID) {
+
+    stress_loop(int(intptr_t(threadID)));
+    return NULL;
+  }
+
+#else
+
+  DWORD WINAPI stress_thread(LPVOID threadID) {
+
+    stress_loop(int(intptr_t(threadID)));
+    return 0;
+  }
+
+#endif
+
+
+  // tt_stress_test() hammers the transposition table from the given number
+  // of threads for the given number of seconds, and reports how many of the
+  // retrieved entries were torn or otherwise inconsistent with their key.
+
+  void tt_stress_test(int threads, int seconds) {
+
+#if !defined(_MSC_VER)
+    pthread_t handles[MAX_THREADS];
+#else
+    HANDLE handles[MAX_THREADS];
+#endif
+
+    TT.clear();
+    TT.new_search();
+    StressStop = false;
+    memset(StressResults, 0, sizeof(StressResults));
+
+    for (int i = 0; i < threads; i++)
+    {
+#if !defined(_MSC_VER)
+        bool ok = (pthread_create(&handles[i], NULL, stress_thread, (void*)intptr_t(i)) == 0);
+#else
+        bool ok = ((handles[i] = CreateThread(NULL, 0, stress_thread, (LPVOID)intptr_t(i), 0, NULL)) != NULL);
+#endif
+        if (!ok)
+        {
+            cerr << "Failed to create thread number " << i << endl;
+            Application::exit_with_failure();
+        }
+    }
+
+#if !defined(_MSC_VER)
+    sleep(seconds);
+#else
+    Sleep(seconds * 1000);
+#endif
+
+    StressStop = true;
+
+    int64_t probes = 0, hits = 0, inconsistent = 0;
+
+    for (int i = 0; i < threads; i++)
+    {
+#if !defined(_MSC_VER)
+        pthread_join(handles[i], NULL);
+#else
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#endif
+        probes += StressResults[i].probes;
+        hits += StressResults[i].hits;
+        inconsistent += StressResults[i].inconsistent;
+    }
+
+    cerr << "==============================="
+         << "\nThreads         : " << threads
+         << "\nProbes          : " << probes
+         << "\nHits            : " << hits
+         << "\nInconsistent    : " << inconsistent << endl << endl;
+  }
+
+
+  // parse_epd() splits a line of the input file into the position, that is
+  // the first four fields plus the move counters when present, and the EPD
+  // operations that follow, which are copied to the output.
+
+  void parse_epd(const string& line, AnalysisJob& job) {
+
+    istringstream ss(line);
+    string token;
+
+    job.done = false;
+
+    for (int i = 0; i < 6 && ss >> token; i++)
+    {
+        // Move counters are optional and EPD operations take their place
+        if (i >= 4 && token.find_first_not_of("0123456789") != string::npos)
+        {
+            job.ops = token;
+            break;
+        }
+        job.fen += (i ? " " : "") + token;
+    }
+
+    if (getline(ss >> ws, token))
+        job.ops += (job.ops.empty() ? "" : " ") + token;
+
+    if (!job.ops.empty() && job.ops[job.ops.size() - 1] != ';')
+        job.ops += ';';
+  }
+
+
+  // analyse_job() searches the position of a job in the given context and
+  // formats the result as an EPD line: the input FEN as it was, then "pm" is
+  // the best move, "ce" the score in centipawns or "dm" the moves to mate,
+  // then the depth, the nodes and the seconds spent and the principal variation.
+
+  void analyse_job(SearchContext* ctx, TranspositionTable& table, AnalysisJob& job) {
+
+    Move moves[1] = {MOVE_NONE};
+    int dummy[2] = {0, 0};
+    SearchResult r;
+    Position pos(job.fen, 0);
+    ostringstream s;
+
+    table.clear();
+    think(ctx, pos, false, false, 0, dummy, dummy, 0, AnalysisDepth, 0, 0, moves);
+    get_search_result(ctx, r);
+
+    s << job.fen;
+
+    if (!job.ops.empty())
+        s << ' ' << job.ops;
+
+    if (r.pv[0] != MOVE_NONE)
+        s << " pm " << move_to_san(pos, r.pv[0]) << ';';
+
+    if (abs(r.score) < VALUE_MATE - 200)
+        s << " ce " << value_to_centipawns(r.score) << ';';
+    else
+        s << " dm " << (r.score > 0 ? (VALUE_MATE - r.score + 1) / 2 : -(VALUE_MATE + r.score) / 2) << ';';
+
+    s << " acd " << r.depth << ';'
+      << " acn " << r.nodes << ';'
+      << " acs " << r.time / 1000 << ';';
+
+    if (r.pv[0] != MOVE_NONE)
+    {
+        string pv = line_to_san(pos, r.pv, 0, false, 0);
+        s << " pv " << pv.substr(0, pv.find_last_not_of(' ') + 1) << ';';
+    }
+
+    job.result = s.str();
+  }
+
+
+  // analysis_loop() is run by each worker of a batch analysis. A worker
+  // searches the positions not yet taken by another worker and then writes
+  // the results that are ready, in input order, until all are done.
+
+  void analysis_loop() {
+
+    TranspositionTable table;
+    table.set_size(AnalysisHash, false);
+    SearchContext* ctx = new_search_context(1, &table);
+
+    while (true)
+    {
+        lock_grab(&AnalysisLock);
+        int idx = NextToSearch++;
+        lock_release(&AnalysisLock);
+
+        if (idx >= int(AnalysisJobs.size()))
+            break;
+
+        analyse_job(ctx, table, AnalysisJobs[idx]);
+
+        lock_grab(&AnalysisLock);
+
+        AnalysisJobs[idx].done = true;
+        while (NextToWrite < int(AnalysisJobs.size()) && AnalysisJobs[NextToWrite].done)
+            AnalysisFile << AnalysisJobs[NextToWrite++].result << endl;
+
+        lock_release(&AnalysisLock);
+    }
+
+    delete_search_context(ctx);
+  }
+
+#if !defined(_MSC_VER)
+
+  void* analysis_thread(void*) {
+
+    analysis_loop();
+    return NULL;
+  }
+
+#else
+
+  DWORD WINAPI analysis_thread(LPVOID) {
+
+    analysis_loop();
+    return 0;
+  }
+
+#endif
+}
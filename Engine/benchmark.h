@@ -33,5 +33,7 @@
 ////
 
 extern void benchmark(const std::string& commandLine);
+extern bool analyse_positions(const std::string& inputFile, const std::string& outputFile,
+                              int depth, int workers);
 
 #endif // !defined(BENCHMARK_H_INCLUDED)
@@ -520,7 +520,10 @@ namespace {
         {
 #if defined(IS_64BIT)
             Bitboard b = index_to_bitboard(k, mask[i]);
-            attacks[index + ((b * mult[i]) >> shift[i])] = sliding_attacks(i, b, 4, deltas);
+            if (CpuHasBMI2)
+                attacks[index + PEXT_INTRINSIC(b, mask[i])] = sliding_attacks(i, b, 4, deltas);
+            else
+                attacks[index + ((b * mult[i]) >> shift[i])] = sliding_attacks(i, b, 4, deltas);
 #else
             Bitboard b = index_to_bitboard(k, mask[i]);
             unsigned v = int(b) * int(mult[i]) ^ int(b >> 32) * int(mult[i] >> 32);
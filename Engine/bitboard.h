@@ -26,6 +26,7 @@
 //// Includes
 ////
 
+#include "bitcount.h"
 #include "direction.h"
 #include "piece.h"
 #include "square.h"
@@ -227,12 +228,34 @@ inline Bitboard ray_bb(Square s, SignedDirection d) {
 
 #if defined(IS_64BIT)
 
+// When the CPU has fast BMI2 (see CpuHasBMI2) the attack tables are filled
+// at startup indexed by pext of the blockers on the mask, otherwise by the
+// magic multiplication. The branch is taken the same way for the whole run.
+#if !defined(USE_BMI2)
+#define PEXT_INTRINSIC(b, m) 0
+#elif defined(_MSC_VER)
+#define PEXT_INTRINSIC(b, m) _pext_u64(b, m)
+#elif defined(__GNUC__)
+
+#define PEXT_INTRINSIC(b, m) ({ \
+   Bitboard __ret; \
+   __asm__("pextq %2, %1, %0" : "=r" (__ret) : "r" (b), "r" (m)); \
+   __ret; })
+
+#endif
+
 inline Bitboard rook_attacks_bb(Square s, Bitboard blockers) {
+  if (CpuHasBMI2)
+      return RAttacks[RAttackIndex[s] + PEXT_INTRINSIC(blockers, RMask[s])];
+
   Bitboard b = blockers & RMask[s];
   return RAttacks[RAttackIndex[s] + ((b * RMult[s]) >> RShift[s])];
 }
 
 inline Bitboard bishop_attacks_bb(Square s, Bitboard blockers) {
+  if (CpuHasBMI2)
+      return BAttacks[BAttackIndex[s] + PEXT_INTRINSIC(blockers, BMask[s])];
+
   Bitboard b = blockers & BMask[s];
   return BAttacks[BAttackIndex[s] + ((b * BMult[s]) >> BShift[s])];
 }
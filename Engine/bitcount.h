@@ -123,6 +123,72 @@ const bool CpuHasPOPCNT = false;
 #endif
 
 
+// Detect hardware AVX2 support. The OS must also save the ymm registers
+// on context switches, as reported by the xgetbv instruction.
+#if defined(USE_AVX2)
+inline bool cpu_has_avx2() {
+
+  int CPUInfo[4] = {-1};
+  __cpuid(CPUInfo, 0x00000000);
+  if (CPUInfo[0] < 7)
+      return false;
+
+  __cpuid(CPUInfo, 0x00000001);
+  if (!((CPUInfo[2] >> 27) & 1)) // OSXSAVE
+      return false;
+
+#if defined(_MSC_VER)
+  unsigned xcr0 = unsigned(_xgetbv(0));
+#else
+  unsigned xcr0, edx;
+  __asm__("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+#endif
+  if ((xcr0 & 6) != 6)
+      return false;
+
+  __cpuid(CPUInfo, 0x00000007);
+  return (CPUInfo[1] >> 5) & 1;
+}
+
+const bool CpuHasAVX2 = cpu_has_avx2();
+#else
+const bool CpuHasAVX2 = false;
+#endif
+
+
+// Detect hardware BMI2 support. AMD processors before family 19h (Zen 3),
+// and the Hygon ones of family 18h derived from Zen, implement pext in
+// microcode, much slower than a magic multiplication, so there we stay with
+// magic bitboards. The pext path exists only in 64-bit mode.
+#if defined(USE_BMI2) && defined(IS_64BIT)
+inline bool cpu_has_bmi2() {
+
+  int CPUInfo[4] = {-1};
+  __cpuid(CPUInfo, 0x00000000);
+  if (CPUInfo[0] < 7)
+      return false;
+
+  bool amd =   CPUInfo[1] == 0x68747541  // "Auth" of "AuthenticAMD"
+             || CPUInfo[1] == 0x6F677948; // "Hygo" of "HygonGenuine"
+
+  __cpuid(CPUInfo, 0x00000001);
+  int family = (CPUInfo[0] >> 8) & 0xF;
+  if (family == 0xF)
+      family += (CPUInfo[0] >> 20) & 0xFF;
+
+  if (amd && family < 0x19)
+      return false;
+
+  __cpuid(CPUInfo, 0x00000007);
+  return (CPUInfo[1] >> 8) & 1;
+}
+
+const bool CpuHasBMI2 = cpu_has_bmi2();
+#else
+const bool CpuHasBMI2 = false;
+#endif
+
+
 // Global constant used to print info about the use of 64 optimized
 // functions to verify that a 64 bit compile has been correctly built.
 #if defined(IS_64BIT)
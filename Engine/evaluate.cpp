@@ -24,6 +24,11 @@
 
 #include <cassert>
 #include <cstring>
+#include <new>
+
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
 
 #include "bitcount.h"
 #include "evaluate.h"
@@ -45,9 +50,8 @@ namespace {
   // Evaluation grain size, must be a power of 2
   const int GrainSize = 8;
 
-  // Evaluation weights, initialized from UCI options
+  // Evaluation weights, initialized from UCI options, see EvalParams
   enum { Mobility, PawnStructure, PassedPawns, Space, KingDangerUs, KingDangerThem };
-  Score Weights[6];
 
   typedef Value V;
   #define S(mg, eg) make_score(mg, eg)
@@ -198,9 +202,9 @@ namespace {
   };
 
   /// King danger constants and variables. The king danger scores are taken
-  /// from the KingDangerTable[]. Various little "meta-bonuses" measuring
-  /// the strength of the enemy attack are added up into an integer, which
-  /// is used as an index to KingDangerTable[].
+  /// from EvalParams::kingDangerTable[]. Various little "meta-bonuses"
+  /// measuring the strength of the enemy attack are added up into an
+  /// integer, which is used as an index to the table.
 
   // KingAttackWeights[] contains king attack weights by piece type
   const int KingAttackWeights[8] = { 0, 0, 2, 2, 3, 5 };
@@ -225,9 +229,6 @@ namespace {
     15, 15, 15, 15, 15, 15, 15, 15
   };
 
-  // KingDangerTable[color][] contains the actual king danger weighted scores
-  Score KingDangerTable[2][128];
-
   // Pawn and material hash tables, indexed by the current thread id.
   // Note that they will be initialized at 0 being global variables.
   MaterialInfoTable* MaterialTable[MAX_THREADS];
@@ -237,9 +238,60 @@ namespace {
   const int PawnTableSize = 16384;
   const int MaterialTableSize = 1024;
 
+  // Evaluation cache, indexed by the current thread id. An entry holds the
+  // evaluation and the king danger of both sides of a position. Each thread
+  // (re)allocates or clears its own cache when the size set by the "Eval
+  // Cache" UCI option or the evaluation settings of its search context have
+  // changed, see refresh_eval_cache().
+  struct EvalCacheEntry {
+    Key key;
+    int16_t value;
+    int16_t kingDanger[2];
+  };
+
+  struct EvalCache {
+    EvalCacheEntry* entries;
+    size_t mask;
+    const EvalParams* params;
+    int sizeMB, generation;
+    uint64_t probes, hits, lazyExits;
+    char pad[64];
+  };
+
+  EvalCache EvalCaches[MAX_THREADS];
+  int EvalCacheSize = 1; // In MB for each thread
+
+  // Evaluation settings of the search context of each thread, indexed by the
+  // thread id, see set_eval_params()
+  const EvalParams* Params[MAX_THREADS];
+
+  // Lazy evaluation. When enabled by the "Lazy Evaluation" UCI option, the
+  // evaluation returns a bound as soon as material, piece squares and pawn
+  // structure are more than LazyMargin outside the search window. The other
+  // terms rarely add up to more than that, but passed pawns and unstoppable
+  // pawns can be worth much more, so positions with passed pawns or where a
+  // side has only pawns are always fully evaluated. So are the positions at
+  // a reduced playing strength, that add some noise to the full evaluation.
+  const Value LazyMargin = Value(0x200);
+
+  // Attack bitboards of the knights, bishops, rooks and queens of one side,
+  // in piece list order. They are collected first and then counted all
+  // together, four at a time when the CPU has AVX2.
+  struct PieceAttacks {
+    Bitboard attacks[16];
+    int mobility[16], kingZoneHit[16], kingAdjacent[16];
+    int count, firstQueen;
+  };
+
+#if defined(USE_AVX2) && defined(__GNUC__)
+#define AVX2_TARGET __attribute__ ((target ("avx2")))
+#elif defined(USE_AVX2)
+#define AVX2_TARGET
+#endif
+
   // Function prototypes
   template<bool HasPopCnt>
-  Value do_evaluate(const Position& pos, EvalInfo& ei);
+  Value do_evaluate(const Position& pos, EvalInfo& ei, Value alpha, Value beta);
 
   template<Color Us, bool HasPopCnt>
   void init_attack_tables(const Position& pos, EvalInfo& ei);
@@ -247,6 +299,13 @@ namespace {
   template<Color Us, bool HasPopCnt>
   void evaluate_pieces_of_color(const Position& pos, EvalInfo& ei);
 
+  template<bool HasPopCnt>
+  void count_attacks(PieceAttacks& pa, Bitboard mobArea, Bitboard kingZone, Bitboard kingAdjacent);
+
+#if defined(USE_AVX2)
+  AVX2_TARGET void count_attacks_avx2(PieceAttacks& pa, Bitboard mobArea, Bitboard kingZone, Bitboard kingAdjacent);
+#endif
+
   template<Color Us, bool HasPopCnt>
   void evaluate_king(const Position& pos, EvalInfo& ei);
 
@@ -265,7 +324,8 @@ namespace {
   inline Score apply_weight(Score v, Score weight);
   Value scale_by_game_phase(const Score& v, Phase ph, const ScaleFactor sf[]);
   Score weight_option(const std::string& mgOpt, const std::string& egOpt, Score internalWeight);
-  void init_safety();
+  void init_safety(EvalParams& p);
+  void refresh_eval_cache(EvalCache& c, const EvalParams* p);
 }
 
 
@@ -275,19 +335,59 @@ namespace {
 
 /// evaluate() is the main evaluation function. It always computes two
 /// values, an endgame score and a middle game score, and interpolates
-/// between them based on the remaining material.
-Value evaluate(const Position& pos, EvalInfo& ei) {
+/// between them based on the remaining material. Positions already
+/// evaluated by the thread are found in its evaluation cache, in this
+/// case only the value and ei.kingDanger[] are set. With lazy evaluation
+/// the value can be only a bound outside of the (alpha, beta) window, then
+/// ei.lazy is set.
+Value evaluate(const Position& pos, EvalInfo& ei, Value alpha, Value beta) {
+
+  EvalCache& c = EvalCaches[pos.thread()];
+  const EvalParams* p = Params[pos.thread()];
+
+  assert(p);
+
+  if (   c.sizeMB != EvalCacheSize
+      || c.params != p
+      || c.generation != p->generation)
+      refresh_eval_cache(c, p);
+
+  if (!c.entries)
+      return CpuHasPOPCNT ? do_evaluate<true>(pos, ei, alpha, beta)
+                          : do_evaluate<false>(pos, ei, alpha, beta);
 
-    return CpuHasPOPCNT ? do_evaluate<true>(pos, ei)
-                        : do_evaluate<false>(pos, ei);
+  EvalCacheEntry* e = c.entries + (pos.get_key() & c.mask);
+  c.probes++;
+
+  if (e->key == pos.get_key())
+  {
+      c.hits++;
+      ei.kingDanger[WHITE] = Value(e->kingDanger[WHITE]);
+      ei.kingDanger[BLACK] = Value(e->kingDanger[BLACK]);
+      return Value(e->value);
+  }
+
+  Value v = CpuHasPOPCNT ? do_evaluate<true>(pos, ei, alpha, beta)
+                         : do_evaluate<false>(pos, ei, alpha, beta);
+
+  // Bounds are good only for the current window
+  if (ei.lazy)
+      return v;
+
+  e->key = pos.get_key();
+  e->value = int16_t(v);
+  e->kingDanger[WHITE] = int16_t(ei.kingDanger[WHITE]);
+  e->kingDanger[BLACK] = int16_t(ei.kingDanger[BLACK]);
+  return v;
 }
 
 namespace {
 
 template<bool HasPopCnt>
-Value do_evaluate(const Position& pos, EvalInfo& ei) {
+Value do_evaluate(const Position& pos, EvalInfo& ei, Value alpha, Value beta) {
 
   ScaleFactor factor[2];
+  const EvalParams& p = *Params[pos.thread()];
 
   assert(pos.is_ok());
   assert(pos.thread() >= 0 && pos.thread() < MAX_THREADS);
@@ -314,7 +414,24 @@ Value do_evaluate(const Position& pos, EvalInfo& ei) {
 
   // Probe the pawn hash table
   ei.pi = PawnTable[pos.thread()]->get_pawn_info(pos);
-  ei.value += apply_weight(ei.pi->pawns_value(), Weights[PawnStructure]);
+  ei.value += apply_weight(ei.pi->pawns_value(), p.weights[PawnStructure]);
+
+  // Lazy evaluation, return a bound if we are already far from the window
+  if (   p.lazy
+      && p.strength >= 0
+      && !ei.pi->passed_pawns()
+      && pos.non_pawn_material(WHITE)
+      && pos.non_pawn_material(BLACK))
+  {
+      Value v = Sign[pos.side_to_move()] * scale_by_game_phase(ei.value, ei.mi->game_phase(), factor);
+
+      if (v - LazyMargin >= beta || v + LazyMargin <= alpha)
+      {
+          EvalCaches[pos.thread()].lazyExits++;
+          ei.lazy = true;
+          return v >= beta ? v - LazyMargin : v + LazyMargin;
+      }
+  }
 
   // Initialize attack bitboards with pawns evaluation
   init_attack_tables<WHITE, HasPopCnt>(pos, ei);
@@ -362,12 +479,12 @@ Value do_evaluate(const Position& pos, EvalInfo& ei) {
       if (ei.mi->space_weight() > 0)
       {
           int s = evaluate_space<WHITE, HasPopCnt>(pos, ei) - evaluate_space<BLACK, HasPopCnt>(pos, ei);
-          ei.value += apply_weight(make_score(s * ei.mi->space_weight(), 0), Weights[Space]);
+          ei.value += apply_weight(make_score(s * ei.mi->space_weight(), 0), p.weights[Space]);
       }
   }
 
   // Mobility
-  ei.value += apply_weight(ei.mobility, Weights[Mobility]);
+  ei.value += apply_weight(ei.mobility, p.weights[Mobility]);
 
   // If we don't already have an unusual scale factor, check for opposite
   // colored bishop endgames, and use a lower scale for those
@@ -402,34 +519,68 @@ Value do_evaluate(const Position& pos, EvalInfo& ei) {
   Value v = Sign[pos.side_to_move()] * scale_by_game_phase(ei.value, phase, factor);
 
   // Cripple eval at low strength settings
-  if (Strength < 0)
-     v += Value(int32_t(pos.get_key()) % (-16 * Strength) + 8 * Strength);
+  if (p.strength < 0)
+     v += Value(int32_t(pos.get_key()) % (-16 * p.strength) + 8 * p.strength);
 
   return v;
 }
 
 } // namespace
 
-/// init_eval() initializes various tables used by the evaluation function
+/// init_eval() allocates the pawn and material hash tables of a thread,
+/// replacing the old ones if any. It is called by each search thread when
+/// it starts, so that the tables are first touched, and then placed by the
+/// OS, on the memory of the NUMA node where the thread runs. For the same
+/// reason the evaluation cache is freed, the thread allocates it again at
+/// its first evaluation.
+
+void init_eval(int threadID) {
+
+  assert(threadID >= 0 && threadID < MAX_THREADS);
+
+  delete PawnTable[threadID];
+  delete MaterialTable[threadID];
+  PawnTable[threadID] = new PawnInfoTable(PawnTableSize);
+  MaterialTable[threadID] = new MaterialInfoTable(MaterialTableSize);
 
-void init_eval(int threads) {
+  delete [] EvalCaches[threadID].entries;
+  EvalCaches[threadID].entries = NULL;
+  EvalCaches[threadID].sizeMB = -1;
+}
+
+
+/// set_eval_cache_size() sets the size in MB of the evaluation cache of each
+/// thread, 0 disables the cache. The threads resize their own cache.
+
+void set_eval_cache_size(int mbSize) {
+
+  EvalCacheSize = Max(mbSize, 0);
+}
+
+
+/// set_eval_params() sets the evaluation settings used by a thread, those
+/// of its search context. It is called while the thread is not searching.
 
-  assert(threads <= MAX_THREADS);
+void set_eval_params(int threadID, const EvalParams* params) {
 
+  assert(threadID >= 0 && threadID < MAX_THREADS);
+
+  Params[threadID] = params;
+}
+
+
+/// eval_cache_stats() returns the number of probes and of hits in the
+/// evaluation caches of all the threads, and how many times the lazy
+/// evaluation has returned early, since the program started.
+
+void eval_cache_stats(uint64_t& probes, uint64_t& hits, uint64_t& lazyExits) {
+
+  probes = hits = lazyExits = 0;
   for (int i = 0; i < MAX_THREADS; i++)
   {
-    if (i >= threads)
-    {
-        delete PawnTable[i];
-        delete MaterialTable[i];
-        PawnTable[i] = NULL;
-        MaterialTable[i] = NULL;
-        continue;
-    }
-    if (!PawnTable[i])
-        PawnTable[i] = new PawnInfoTable(PawnTableSize);
-    if (!MaterialTable[i])
-        MaterialTable[i] = new MaterialInfoTable(MaterialTableSize);
+      probes += EvalCaches[i].probes;
+      hits += EvalCaches[i].hits;
+      lazyExits += EvalCaches[i].lazyExits;
   }
 }
 
@@ -444,32 +595,47 @@ void quit_eval() {
       delete MaterialTable[i];
       PawnTable[i] = NULL;
       MaterialTable[i] = NULL;
+      delete [] EvalCaches[i].entries;
+      EvalCaches[i].entries = NULL;
   }
 }
 
 
-/// read_weights() reads evaluation weights from the corresponding UCI parameters
+/// read_weights() reads evaluation weights and the other evaluation settings
+/// from the corresponding UCI parameters into those of a search context.
 
-void read_weights(Color us) {
+void read_weights(EvalParams& p, Color us, int strength) {
 
   // King safety is asymmetrical. Our king danger level is weighted by
   // "Cowardice" UCI parameter, instead the opponent one by "Aggressiveness".
   const int kingDangerUs   = (us == WHITE ? KingDangerUs   : KingDangerThem);
   const int kingDangerThem = (us == WHITE ? KingDangerThem : KingDangerUs);
+  const EvalParams old = p;
 
-  Weights[Mobility]       = weight_option("Mobility (Middle Game)", "Mobility (Endgame)", WeightsInternal[Mobility]);
-  Weights[PawnStructure]  = weight_option("Pawn Structure (Middle Game)", "Pawn Structure (Endgame)", WeightsInternal[PawnStructure]);
-  Weights[PassedPawns]    = weight_option("Passed Pawns (Middle Game)", "Passed Pawns (Endgame)", WeightsInternal[PassedPawns]);
-  Weights[Space]          = weight_option("Space", "Space", WeightsInternal[Space]);
-  Weights[kingDangerUs]   = weight_option("Cowardice", "Cowardice", WeightsInternal[KingDangerUs]);
-  Weights[kingDangerThem] = weight_option("Aggressiveness", "Aggressiveness", WeightsInternal[KingDangerThem]);
+  p.weights[Mobility]       = weight_option("Mobility (Middle Game)", "Mobility (Endgame)", WeightsInternal[Mobility]);
+  p.weights[PawnStructure]  = weight_option("Pawn Structure (Middle Game)", "Pawn Structure (Endgame)", WeightsInternal[PawnStructure]);
+  p.weights[PassedPawns]    = weight_option("Passed Pawns (Middle Game)", "Passed Pawns (Endgame)", WeightsInternal[PassedPawns]);
+  p.weights[Space]          = weight_option("Space", "Space", WeightsInternal[Space]);
+  p.weights[kingDangerUs]   = weight_option("Cowardice", "Cowardice", WeightsInternal[KingDangerUs]);
+  p.weights[kingDangerThem] = weight_option("Aggressiveness", "Aggressiveness", WeightsInternal[KingDangerThem]);
 
   // If running in analysis mode, make sure we use symmetrical king safety. We do this
-  // by replacing both Weights[kingDangerUs] and Weights[kingDangerThem] by their average.
+  // by replacing both weights[kingDangerUs] and weights[kingDangerThem] by their average.
   if (get_option_value_bool("UCI_AnalyseMode"))
-      Weights[kingDangerUs] = Weights[kingDangerThem] = (Weights[kingDangerUs] + Weights[kingDangerThem]) / 2;
+      p.weights[kingDangerUs] = p.weights[kingDangerThem] = (p.weights[kingDangerUs] + p.weights[kingDangerThem]) / 2;
 
-  init_safety();
+  init_safety(p);
+
+  p.strength = strength;
+  p.chess960 = get_option_value_bool("UCI_Chess960");
+  p.lazy = get_option_value_bool("Lazy Evaluation");
+
+  // Cached evaluations are stale if any of the settings has changed
+  if (   memcmp(old.weights, p.weights, sizeof(p.weights))
+      || old.strength != p.strength
+      || old.chess960 != p.chess960
+      || old.lazy != p.lazy)
+      p.generation++;
 }
 
 
@@ -517,19 +683,19 @@ namespace {
   }
 
 
-  // evaluate_pieces<>() assigns bonuses and penalties to the pieces of a given color
+  // collect_attacks<>() finds the squares attacked by the pieces of a given
+  // color and type and appends them to the PieceAttacks list.
 
-  template<PieceType Piece, Color Us, bool HasPopCnt>
-  void evaluate_pieces(const Position& pos, EvalInfo& ei, Bitboard no_mob_area) {
+  template<PieceType Piece, Color Us>
+  void collect_attacks(const Position& pos, EvalInfo& ei, PieceAttacks& pa) {
 
     Bitboard b;
-    Square s, ksq;
-    int mob;
-    File f;
-
-    const Color Them = (Us == WHITE ? BLACK : WHITE);
+    Square s;
     const Square* ptr = pos.piece_list_begin(Us, Piece);
 
+    if (Piece == QUEEN)
+        pa.firstQueen = pa.count;
+
     while ((s = *ptr++) != SQ_NONE)
     {
         // Find attacked squares, including x-ray attacks for bishops and rooks
@@ -545,19 +711,126 @@ namespace {
         // Update attack info
         ei.attackedBy[Us][Piece] |= b;
 
+        assert(pa.count < 16);
+        pa.attacks[pa.count++] = b;
+    }
+  }
+
+
+  // count_attacks<>() computes for each collected attack bitboard the number
+  // of squares in the mobility area, whether the enemy king zone is hit and,
+  // in that case, the number of attacked squares adjacent to the enemy king.
+
+  template<bool HasPopCnt>
+  void count_attacks(PieceAttacks& pa, Bitboard mobArea, Bitboard kingZone, Bitboard kingAdjacent) {
+
+#if defined(USE_AVX2)
+    if (CpuHasAVX2)
+    {
+        count_attacks_avx2(pa, mobArea, kingZone, kingAdjacent);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < pa.count; i++)
+    {
+        Bitboard b = pa.attacks[i];
+
+        pa.mobility[i] = (i < pa.firstQueen ? count_1s_max_15<HasPopCnt>(b & mobArea)
+                                            : count_1s<HasPopCnt>(b & mobArea));
+
+        pa.kingZoneHit[i] = (b & kingZone) != EmptyBoardBB;
+        pa.kingAdjacent[i] = (pa.kingZoneHit[i] ? count_1s_max_15<HasPopCnt>(b & kingAdjacent) : 0);
+    }
+  }
+
+
+#if defined(USE_AVX2)
+
+  // popcount_epi64() counts the nonzero bits of the four 64 bit lanes of an
+  // AVX2 register with a nibble lookup table, summing up the bytes with psadbw.
+
+  AVX2_TARGET inline __m256i popcount_epi64(__m256i v) {
+
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0F);
+
+    __m256i lo = _mm256_and_si256(v, lowNibbles);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibbles);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+  }
+
+
+  // count_attacks_avx2() is the AVX2 version of count_attacks<>(), it
+  // processes four pieces in parallel lanes.
+
+  AVX2_TARGET void count_attacks_avx2(PieceAttacks& pa, Bitboard mobArea, Bitboard kingZone, Bitboard kingAdjacent) {
+
+    const __m256i mobMask = _mm256_set1_epi64x(int64_t(mobArea));
+    const __m256i zoneMask = _mm256_set1_epi64x(int64_t(kingZone));
+    const __m256i adjMask = _mm256_set1_epi64x(int64_t(kingAdjacent));
+    const __m256i zero = _mm256_setzero_si256();
+
+    CACHE_LINE_ALIGNMENT int64_t mob[4], hit[4], adj[4];
+
+    // Pad the last group of lanes with empty bitboards
+    for (int i = pa.count; i & 3; i++)
+        pa.attacks[i] = EmptyBoardBB;
+
+    for (int i = 0; i < pa.count; i += 4)
+    {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(pa.attacks + i));
+
+        // A lane of the king zone hit mask is all ones when the zone is not hit
+        __m256i miss = _mm256_cmpeq_epi64(_mm256_and_si256(b, zoneMask), zero);
+
+        _mm256_store_si256((__m256i*)mob, popcount_epi64(_mm256_and_si256(b, mobMask)));
+        _mm256_store_si256((__m256i*)hit, miss);
+        _mm256_store_si256((__m256i*)adj, popcount_epi64(_mm256_andnot_si256(miss, _mm256_and_si256(b, adjMask))));
+
+        for (int j = 0; j < 4 && i + j < pa.count; j++)
+        {
+            pa.mobility[i + j] = int(mob[j]);
+            pa.kingZoneHit[i + j] = !hit[j];
+            pa.kingAdjacent[i + j] = int(adj[j]);
+        }
+    }
+  }
+
+#endif
+
+
+  // evaluate_pieces<>() assigns bonuses and penalties to the pieces of a given
+  // color and type. Attack bitboards and their counts are read from the
+  // PieceAttacks list, starting at index 'idx'.
+
+  template<PieceType Piece, Color Us>
+  void evaluate_pieces(const Position& pos, EvalInfo& ei, const PieceAttacks& pa, int& idx) {
+
+    Square s, ksq;
+    int mob;
+    File f;
+
+    const Color Them = (Us == WHITE ? BLACK : WHITE);
+    const Square* ptr = pos.piece_list_begin(Us, Piece);
+
+    while ((s = *ptr++) != SQ_NONE)
+    {
+        int i = idx++;
+
         // King attacks
-        if (b & ei.kingZone[Us])
+        if (pa.kingZoneHit[i])
         {
             ei.kingAttackersCount[Us]++;
             ei.kingAttackersWeight[Us] += KingAttackWeights[Piece];
-            Bitboard bb = (b & ei.attackedBy[Them][KING]);
-            if (bb)
-                ei.kingAdjacentZoneAttacksCount[Us] += count_1s_max_15<HasPopCnt>(bb);
+            ei.kingAdjacentZoneAttacksCount[Us] += pa.kingAdjacent[i];
         }
 
         // Mobility
-        mob = (Piece != QUEEN ? count_1s_max_15<HasPopCnt>(b & no_mob_area)
-                              : count_1s<HasPopCnt>(b & no_mob_area));
+        mob = pa.mobility[i];
 
         ei.mobility += Sign[Us] * MobilityBonus[Piece][mob];
 
@@ -577,7 +850,7 @@ namespace {
             if (bit_is_set(MaskA7H7[Us], s))
                 evaluate_trapped_bishop_a7h7(pos, s, Us, ei);
 
-            if (Chess960 && bit_is_set(MaskA1H1[Us], s))
+            if (Params[pos.thread()]->chess960 && bit_is_set(MaskA1H1[Us], s))
                 evaluate_trapped_bishop_a1h1(pos, s, Us, ei);
         }
 
@@ -676,10 +949,22 @@ namespace {
     // Do not include in mobility squares protected by enemy pawns or occupied by our pieces
     const Bitboard no_mob_area = ~(ei.attackedBy[Them][PAWN] | pos.pieces_of_color(Us));
 
-    evaluate_pieces<KNIGHT, Us, HasPopCnt>(pos, ei, no_mob_area);
-    evaluate_pieces<BISHOP, Us, HasPopCnt>(pos, ei, no_mob_area);
-    evaluate_pieces<ROOK,   Us, HasPopCnt>(pos, ei, no_mob_area);
-    evaluate_pieces<QUEEN,  Us, HasPopCnt>(pos, ei, no_mob_area);
+    PieceAttacks pa;
+    pa.count = 0;
+
+    collect_attacks<KNIGHT, Us>(pos, ei, pa);
+    collect_attacks<BISHOP, Us>(pos, ei, pa);
+    collect_attacks<ROOK,   Us>(pos, ei, pa);
+    collect_attacks<QUEEN,  Us>(pos, ei, pa);
+
+    count_attacks<HasPopCnt>(pa, no_mob_area, ei.kingZone[Us], ei.attackedBy[Them][KING]);
+
+    int idx = 0;
+
+    evaluate_pieces<KNIGHT, Us>(pos, ei, pa, idx);
+    evaluate_pieces<BISHOP, Us>(pos, ei, pa, idx);
+    evaluate_pieces<ROOK,   Us>(pos, ei, pa, idx);
+    evaluate_pieces<QUEEN,  Us>(pos, ei, pa, idx);
 
     // Sum up all attacked squares
     ei.attackedBy[Us][0] =   ei.attackedBy[Us][PAWN]   | ei.attackedBy[Us][KNIGHT]
@@ -725,7 +1010,7 @@ namespace {
                         | ei.attacked_by(Us, QUEEN));
 
         // Initialize the 'attackUnits' variable, which is used later on as an
-        // index to the KingDangerTable[] array. The initial value is based on
+        // index to the kingDangerTable[] array. The initial value is based on
         // the number and types of the enemy's attacking pieces, the number of
         // attacked and undefended squares around our king, the square of the
         // king, and the quality of the pawn shelter.
@@ -772,16 +1057,17 @@ namespace {
         if (b)
             attackUnits += KnightCheckBonus * count_1s_max_15<HasPopCnt>(b);
 
-        // To index KingDangerTable[] attackUnits must be in [0, 99] range
+        // To index kingDangerTable[] attackUnits must be in [0, 99] range
         attackUnits = Min(99, Max(0, attackUnits));
 
-        // Finally, extract the king danger score from the KingDangerTable[]
+        // Finally, extract the king danger score from the kingDangerTable[]
         // array and subtract the score from evaluation. Set also ei.kingDanger[]
         // value that will be used for pruning because this value can sometimes
         // be very big, and so capturing a single attacking piece can therefore
         // result in a score change far bigger than the value of the captured piece.
-        ei.value -= Sign[Us] * KingDangerTable[Us][attackUnits];
-        ei.kingDanger[Us] = mg_value(KingDangerTable[Us][attackUnits]);
+        Score danger = Params[pos.thread()]->kingDangerTable[Us][attackUnits];
+        ei.value -= Sign[Us] * danger;
+        ei.kingDanger[Us] = mg_value(danger);
     }
   }
 
@@ -874,7 +1160,7 @@ namespace {
         }
 
         // Add the scores for this pawn to the middle game and endgame eval
-        ei.value += Sign[Us] * apply_weight(make_score(mbonus, ebonus), Weights[PassedPawns]);
+        ei.value += Sign[Us] * apply_weight(make_score(mbonus, ebonus), Params[pos.thread()]->weights[PassedPawns]);
 
     } // while
   }
@@ -1003,7 +1289,7 @@ namespace {
     Piece pawn = piece_of_color_and_type(us, PAWN);
     Square b2, b3, c3;
 
-    assert(Chess960);
+    assert(Params[pos.thread()]->chess960);
     assert(square_is_ok(s));
     assert(pos.piece_on(s) == piece_of_color_and_type(us, BISHOP));
 
@@ -1103,7 +1389,7 @@ namespace {
   // init_safety() initizes the king safety evaluation, based on UCI
   // parameters. It is called from read_weights().
 
-  void init_safety() {
+  void init_safety(EvalParams& p) {
 
     const Value MaxSlope = Value(30);
     const Value Peak = Value(1280);
@@ -1120,9 +1406,35 @@ namespace {
         t[i] = Min(t[i], Peak);
     }
 
-    // Then apply the weights and get the final KingDangerTable[] array
+    // Then apply the weights and get the final kingDangerTable[] array
     for (Color c = WHITE; c <= BLACK; c++)
         for (int i = 0; i < 100; i++)
-            KingDangerTable[c][i] = apply_weight(make_score(t[i], 0), Weights[KingDangerUs + c]);
+            p.kingDangerTable[c][i] = apply_weight(make_score(t[i], 0), p.weights[KingDangerUs + c]);
   }
+
+  // refresh_eval_cache() allocates the evaluation cache of the calling thread
+  // with the current size, or clears it if the size has not changed. If the
+  // memory cannot be allocated the cache is disabled.
+
+  void refresh_eval_cache(EvalCache& c, const EvalParams* p) {
+
+    if (c.sizeMB != EvalCacheSize)
+    {
+        size_t n = 1;
+        while (2 * n * sizeof(EvalCacheEntry) <= (size_t(EvalCacheSize) << 20))
+            n *= 2;
+
+        delete [] c.entries;
+        c.entries = EvalCacheSize ? new (std::nothrow) EvalCacheEntry[n] : NULL;
+        c.mask = n - 1;
+        c.sizeMB = EvalCacheSize;
+    }
+
+    if (c.entries)
+        memset(c.entries, 0, (c.mask + 1) * sizeof(EvalCacheEntry));
+
+    c.params = p;
+    c.generation = p->generation;
+  }
+
 }
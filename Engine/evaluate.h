@@ -47,7 +47,7 @@ class Position;
 
 struct EvalInfo {
 
-  EvalInfo() { kingDanger[0] = kingDanger[1] = Value(0); }
+  EvalInfo() { kingDanger[0] = kingDanger[1] = Value(0); lazy = false; }
 
   // Middle game and endgame evaluations
   Score value;
@@ -94,6 +94,29 @@ struct EvalInfo {
 
   // Value of the danger for the king of the given color
   Value kingDanger[2];
+
+  // True if the lazy evaluation has returned only a bound, then the other
+  // fields are not computed and kingDanger[] is zero.
+  bool lazy;
+};
+
+
+/// The EvalParams struct holds the evaluation settings of a search context:
+/// the weights read from the UCI options, the king danger table built from
+/// them, the playing strength, the variant and the lazy evaluation switch.
+/// Each context has its own, see set_eval_params(), so that a search never
+/// sees the settings of another context change under its feet.
+
+struct EvalParams {
+
+  EvalParams() { strength = 0; chess960 = lazy = false; generation = 0; }
+
+  Score weights[6];
+  Score kingDangerTable[2][128];
+  int strength;
+  bool chess960;
+  bool lazy;
+  int generation; // Raised when cached evaluations become stale
 };
 
 
@@ -101,10 +124,13 @@ struct EvalInfo {
 //// Prototypes
 ////
 
-extern Value evaluate(const Position& pos, EvalInfo& ei);
-extern void init_eval(int threads);
+extern Value evaluate(const Position& pos, EvalInfo& ei, Value alpha = -VALUE_INFINITE, Value beta = VALUE_INFINITE);
+extern void init_eval(int threadID);
 extern void quit_eval();
-extern void read_weights(Color sideToMove);
+extern void set_eval_cache_size(int mbSize);
+extern void set_eval_params(int threadID, const EvalParams* params);
+extern void eval_cache_stats(uint64_t& probes, uint64_t& hits, uint64_t& lazyExits);
+extern void read_weights(EvalParams& params, Color sideToMove, int strength);
 
 
 #endif // !defined(EVALUATE_H_INCLUDED)
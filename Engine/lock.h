@@ -99,4 +99,27 @@ typedef CRITICAL_SECTION Lock;
 
 #endif
 
+
+// memory_barrier() is a full memory fence. It is used where a thread
+// publishes some data and then signals it with a plain store to a volatile
+// flag, and on the other side between reading the flag and the data, so
+// that also weakly ordered CPUs, like ARM, see them in the right order.
+
+#if defined(_MSC_VER)
+#  define memory_barrier() MemoryBarrier()
+#else
+#  define memory_barrier() __sync_synchronize()
+#endif
+
+
+// compare_and_swap() atomically sets the int pointed to by x to newV if it
+// is equal to oldV, and returns true if it has done so.
+
+#if defined(_MSC_VER)
+#  define compare_and_swap(x, oldV, newV) \
+     (InterlockedCompareExchange((volatile LONG*)(x), LONG(newV), LONG(oldV)) == LONG(oldV))
+#else
+#  define compare_and_swap(x, oldV, newV) __sync_bool_compare_and_swap(x, oldV, newV)
+#endif
+
 #endif // !defined(LOCK_H_INCLUDED)
@@ -25,6 +25,7 @@
 //// Includes
 ////
 
+#include <cstdlib>
 #include <iostream>
 #include <string>
 
@@ -32,6 +33,7 @@
 #include "bitcount.h"
 #include "misc.h"
 #include "uci.h"
+#include "ucioption.h"
 
 #ifdef USE_CALLGRIND
 #include <valgrind/callgrind.h>
@@ -71,11 +73,18 @@ int main(int argc, char *argv[]) {
   }
   else // Process command line arguments
   {
-      if (string(argv[1]) != "bench" || argc < 4 || argc > 8)
+      if (string(argv[1]) == "analyse" && argc == 7)
+      {
+          set_option_value("Hash", argv[2]);
+          analyse_positions(argv[5], argv[6], atoi(argv[4]), atoi(argv[3]));
+      }
+      else if (string(argv[1]) != "bench" || argc < 4 || argc > 8)
           cout << "Usage: stockfish bench <hash size> <threads> "
                << "[time = 60s] [fen positions file = default] "
-               << "[time, depth, perft or node limited = time] "
-               << "[timing file name = none]" << endl;
+               << "[time, depth, perft, divide, ttstress, split, overshoot or node limited = time] "
+               << "[timing file name = none]\n"
+               << "       stockfish analyse <hash size> <workers> <depth> "
+               << "<epd positions file> <output file>" << endl;
       else
       {
           string time = argc > 4 ? argv[4] : "60";
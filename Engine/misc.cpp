@@ -24,12 +24,16 @@
 
 #if !defined(_MSC_VER)
 
+#  include <sys/resource.h>
 #  include <sys/time.h>
 #  include <sys/types.h>
 #  include <unistd.h>
 #  if defined(__hpux)
 #     include <sys/pstat.h>
 #  endif
+#  if defined(__APPLE__)
+#     include <mach/mach_time.h>
+#  endif
 
 #else
 
@@ -47,9 +51,12 @@
 
 #include <cassert>
 #include <cstdio>
+#include <deque>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "bitcount.h"
 #include "misc.h"
@@ -70,7 +77,6 @@ static const string AppTag  = "";
 ////
 
 bool Chess960;
-int Strength;
 
 uint64_t dbg_cnt0 = 0;
 uint64_t dbg_cnt1 = 0;
@@ -147,11 +153,21 @@ void dbg_print_mean(ofstream& logFile) {
 /// engine_name() returns the full name of the current Stockfish version.
 /// This will be either "Stockfish YYMMDD" (where YYMMDD is the date when the
 /// program was compiled) or "Stockfish <version number>", depending on whether
-/// the constant EngineVersion (defined in misc.h) is empty.
+/// the constant EngineVersion (defined in misc.h) is empty. The code paths
+/// selected for the CPU at startup are appended.
 
 const string engine_name() {
 
-  const string cpu64(CpuHas64BitPath ? " 64bit" : "");
+  string cpu64(CpuHas64BitPath ? " 64bit" : "");
+
+  if (CpuHasPOPCNT)
+      cpu64 += " POPCNT";
+
+  if (CpuHasBMI2)
+      cpu64 += " BMI2";
+
+  if (CpuHasAVX2)
+      cpu64 += " AVX2";
 
   if (!EngineVersion.empty())
       return AppName + " " + EngineVersion + cpu64;
@@ -190,87 +206,304 @@ int get_system_time() {
 }
 
 
+/// get_monotonic_time() returns the time of a clock that is never set back,
+/// measured in milliseconds from an arbitrary origin. Searches are timed
+/// with it, so that a clock adjustment cannot stop them or let them run on.
+
+int get_monotonic_time() {
+
+#if defined(_MSC_VER)
+    return int(GetTickCount());
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t tb;
+    if (!tb.denom)
+        mach_timebase_info(&tb);
+    return int(mach_absolute_time() * tb.numer / tb.denom / 1000000);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int(t.tv_sec * 1000 + t.tv_nsec / 1000000);
+#endif
+}
+
+
+/// get_monotonic_time_us() is get_monotonic_time() measured in microseconds.
+/// It is used to time short events, like a thread joining a split point, and
+/// to throttle the search in strength handicap mode.
+
+int64_t get_monotonic_time_us() {
+
+#if defined(_MSC_VER)
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return int64_t(t.QuadPart * 1000000 / f.QuadPart);
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t tb;
+    if (!tb.denom)
+        mach_timebase_info(&tb);
+    return int64_t(mach_absolute_time() * tb.numer / tb.denom / 1000);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000 + t.tv_nsec / 1000;
+#endif
+}
+
+
+/// get_cpu_time() returns the CPU time used so far by all the threads of
+/// the process, measured in milliseconds.
+
+int get_cpu_time() {
+
+#if defined(_MSC_VER)
+    FILETIME c, e, k, u;
+    GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u);
+    return int(((uint64_t(k.dwHighDateTime) << 32 | k.dwLowDateTime)
+              + (uint64_t(u.dwHighDateTime) << 32 | u.dwLowDateTime)) / 10000);
+#else
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    return int(  (r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1000
+               + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1000);
+#endif
+}
+
+
 /// cpu_count() tries to detect the number of CPU cores.
 
+#if defined(_MSC_VER)
+
+int cpu_count() {
+
+  SYSTEM_INFO s;
+  GetSystemInfo(&s);
+  return Min(int(s.dwNumberOfProcessors), MAX_THREADS);
+}
+
+#else
+
 int cpu_count() {
+
+#if defined(_SC_NPROCESSORS_ONLN)
+  return Max(1, Min(int(sysconf(_SC_NPROCESSORS_ONLN)), MAX_THREADS));
+#elif defined(__hpux)
+  struct pst_dynamic psd;
+  if (pstat_getdynamic(&psd, sizeof(psd), (size_t)1, 0) == -1)
+      return 1;
+
+  return Min(int(psd.psd_proc_cnt), MAX_THREADS);
+#else
   return 1;
+#endif
 }
 
+#endif
 
-/*
-  From Beowulf, from Olithink
-*/
-#ifndef _WIN32
-/* Non-windows version */
-int Bioskey()
-{
-  fd_set          readfds;
-  struct timeval  timeout;
-
-  FD_ZERO(&readfds);
-  FD_SET(fileno(stdin), &readfds);
-  /* Set to timeout immediately */
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  select(16, &readfds, 0, 0, &timeout);
-
-  return (FD_ISSET(fileno(stdin), &readfds));
+
+/// cpu_order() returns the logical CPUs sorted by NUMA node: first all the
+/// CPUs of node 0, then the ones of node 1 and so on. On Linux the nodes are
+/// read from /sys, elsewhere, or without NUMA, the CPUs are in natural order.
+
+static const vector<int>& cpu_order() {
+
+  static vector<int> cpus;
+
+  if (!cpus.empty())
+      return cpus;
+
+#if defined(__linux__)
+  for (int node = 0; ; node++)
+  {
+      ostringstream name;
+      name << "/sys/devices/system/node/node" << node << "/cpulist";
+      ifstream f(name.str().c_str());
+      string range;
+
+      if (!f.is_open())
+          break;
+
+      // The list is like "0-7,16-23"
+      while (getline(f, range, ','))
+      {
+          int first, last;
+          char dash;
+          istringstream r(range);
+
+          if (!(r >> first))
+              continue;
+          if (!(r >> dash >> last))
+              last = first;
+          for (int c = first; c <= last; c++)
+              cpus.push_back(c);
+      }
+  }
+#endif
+
+  if (cpus.empty())
+      for (int c = 0; c < cpu_count(); c++)
+          cpus.push_back(c);
+
+  return cpus;
 }
 
+
+/// bind_this_thread() pins the calling thread to one logical CPU, chosen by
+/// the thread index in the order of cpu_order(), so that search threads fill
+/// one NUMA node before to use the next one. A negative index lets the thread
+/// run again on any CPU. Binding is not supported on Mac OS X and iOS, where
+/// this is a no-op.
+
+void bind_this_thread(int threadID) {
+
+  const vector<int>& cpus = cpu_order();
+
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  if (threadID < 0)
+      for (size_t i = 0; i < cpus.size(); i++)
+          CPU_SET(cpus[i], &set);
+  else
+      CPU_SET(cpus[threadID % cpus.size()], &set);
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+#elif defined(_MSC_VER)
+  DWORD_PTR mask = 0;
+
+  if (threadID < 0)
+      for (size_t i = 0; i < cpus.size() && cpus[i] < 64; i++)
+          mask |= DWORD_PTR(1) << cpus[i];
+  else
+      mask = DWORD_PTR(1) << (cpus[threadID % cpus.size()] % 64);
+
+  SetThreadAffinityMask(GetCurrentThread(), mask);
 #else
-/* Windows-version */
-#include <windows.h>
-#include <conio.h>
-int Bioskey()
-{
-    static int      init = 0,
-                    pipe;
-    static HANDLE   inh;
-    DWORD           dw;
-    /* If we're running under XBoard then we can't use _kbhit() as the input
-     * commands are sent to us directly over the internal pipe */
-
-#if defined(FILE_CNT)
-    if (stdin->_cnt > 0)
-        return stdin->_cnt;
+  (void)cpus;
+  (void)threadID;
 #endif
-    if (!init) {
-        init = 1;
-        inh = GetStdHandle(STD_INPUT_HANDLE);
-        pipe = !GetConsoleMode(inh, &dw);
-        if (!pipe) {
-            SetConsoleMode(inh, dw & ~(ENABLE_MOUSE_INPUT | ENABLE_WINDOW_INPUT));
-            FlushConsoleInputBuffer(inh);
-        }
-    }
-    if (pipe) {
-        if (!PeekNamedPipe(inh, NULL, 0, NULL, &dw, NULL))
-            return 1;
-        return dw;
-    } else {
-        // Count the number of unread input records, including keyboard,
-        // mouse, and window-resizing input records.
-        GetNumberOfConsoleInputEvents(inh, &dw);
-        if (dw <= 0)
-            return 0;
-
-        // Read data from console without removing it from the buffer
-        INPUT_RECORD rec[256];
-        DWORD recCnt;
-        if (!PeekConsoleInput(inh, rec, Min(dw, 256), &recCnt))
-            return 0;
-
-        // Search for at least one keyboard event
-        for (DWORD i = 0; i < recCnt; i++)
-            if (rec[i].EventType == KEY_EVENT)
-                return 1;
-
-        return 0;
-    }
 }
 
+
+/// The input thread reads the standard input and queues the lines in
+/// InputLines, protected by InputLock. A reader waits for them on InputCond.
+
+static deque<string> InputLines;
+static bool InputThreadStarted = false;
+static Lock InputLock;
+#if !defined(_MSC_VER)
+static pthread_cond_t InputCond;
+#else
+static HANDLE InputEvent;
 #endif
 
+static void input_loop() {
+
+  string line;
+  bool eof = false;
+
+  while (!eof)
+  {
+      if (!getline(cin, line))
+      {
+          line = "quit";
+          eof = true;
+      }
+
+      lock_grab(&InputLock);
+      InputLines.push_back(line);
+#if !defined(_MSC_VER)
+      pthread_cond_signal(&InputCond);
+#else
+      SetEvent(InputEvent);
+#endif
+      lock_release(&InputLock);
+  }
+}
+
+#if !defined(_MSC_VER)
+static void* input_thread(void*) { input_loop(); return NULL; }
+#else
+static DWORD WINAPI input_thread(LPVOID) { input_loop(); return 0; }
+#endif
+
+
+/// start_input_thread() launches a thread that reads the standard input one
+/// line at a time, so that the search can check for commands without asking
+/// the OS. input_available() tells if a line is waiting and read_input()
+/// returns the next line, waiting for it if needed. After the end of the
+/// input read_input() returns "quit".
+
+void start_input_thread() {
+
+  if (InputThreadStarted)
+      return;
+
+  lock_init(&InputLock, NULL);
+
+#if !defined(_MSC_VER)
+  pthread_t pthread[1];
+  pthread_cond_init(&InputCond, NULL);
+  bool ok = (pthread_create(pthread, NULL, input_thread, NULL) == 0);
+  if (ok)
+      pthread_detach(pthread[0]);
+#else
+  InputEvent = CreateEvent(0, FALSE, FALSE, 0);
+  HANDLE h = CreateThread(NULL, 0, input_thread, NULL, 0, NULL);
+  bool ok = (h != NULL);
+  if (ok)
+      CloseHandle(h);
+#endif
+
+  if (!ok)
+  {
+      cout << "Failed to create the input thread" << endl;
+      Application::exit_with_failure();
+  }
+  InputThreadStarted = true;
+}
+
+bool input_available() {
+
+  if (!InputThreadStarted)
+      return false;
+
+  lock_grab(&InputLock);
+  bool available = !InputLines.empty();
+  lock_release(&InputLock);
+
+  return available;
+}
+
+string read_input() {
+
+  string line;
+
+  if (!InputThreadStarted)
+      return getline(cin, line) ? line : "quit";
+
+  lock_grab(&InputLock);
+
+  while (InputLines.empty())
+  {
+#if !defined(_MSC_VER)
+      pthread_cond_wait(&InputCond, &InputLock);
+#else
+      lock_release(&InputLock);
+      WaitForSingleObject(InputEvent, INFINITE);
+      lock_grab(&InputLock);
+#endif
+  }
+  line = InputLines.front();
+  InputLines.pop_front();
+
+  lock_release(&InputLock);
+
+  return line;
+}
+
+
 /// prefetch() preloads the given address in L1/L2 cache. This is a non
 /// blocking function and do not stalls the CPU waiting for data to be
 /// loaded from RAM, that can be very slow.
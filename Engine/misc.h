@@ -45,7 +45,6 @@
 ////
 
 extern bool Chess960;
-extern int Strength;
 
 
 ////
@@ -54,8 +53,14 @@ extern int Strength;
 
 extern const std::string engine_name();
 extern int get_system_time();
+extern int get_monotonic_time();
+extern int64_t get_monotonic_time_us();
+extern int get_cpu_time();
 extern int cpu_count();
-extern int Bioskey();
+extern void bind_this_thread(int threadID);
+extern void start_input_thread();
+extern bool input_available();
+extern std::string read_input();
 extern void prefetch(char* addr);
 
 
@@ -54,6 +54,16 @@ Score Position::PieceSquareTable[16][64];
 
 static bool RequestPending = false;
 
+#if defined(USE_ATTACK_MAPS)
+// Attack maps to refresh in Position::update_attacks() are passed as a bit
+// mask with one bit for each color and piece type.
+static const int AllAttackMaps = 0xFFFF;
+
+static inline int attack_map_bit(Color c, PieceType pt) {
+  return 1 << (8 * int(c) + int(pt));
+}
+#endif
+
 
 /// Constructors
 
@@ -249,6 +259,10 @@ void Position::from_fen(const string& fen) {
 
   find_checkers();
 
+#if defined(USE_ATTACK_MAPS)
+  update_attacks(AllAttackMaps, EmptyBoardBB);
+#endif
+
   st->key = compute_key();
   st->pawnKey = compute_pawn_key();
   st->materialKey = compute_material_key();
@@ -501,6 +515,63 @@ void Position::find_checkers() {
 }
 
 
+#if defined(USE_ATTACK_MAPS)
+
+/// Position::compute_attacks() computes from scratch the squares attacked by
+/// the pieces of a given color and type.
+
+Bitboard Position::compute_attacks(Color c, PieceType pt) const {
+
+  if (pt == PAWN)
+  {
+      Bitboard b = pieces(PAWN, c);
+      return c == WHITE ? ((b << 9) & ~FileABB) | ((b << 7) & ~FileHBB)
+                        : ((b >> 7) & ~FileABB) | ((b >> 9) & ~FileHBB);
+  }
+
+  Bitboard b = EmptyBoardBB;
+  Piece p = piece_of_color_and_type(c, pt);
+  const Square* ptr = piece_list_begin(c, pt);
+  Square s;
+
+  while ((s = *ptr++) != SQ_NONE)
+      b |= attacks_from(p, s);
+
+  return b;
+}
+
+
+/// Position::update_attacks() refreshes the attack maps of the current state
+/// after the board has changed. The 'dirty' mask flags the piece sets that
+/// moved, appeared or disappeared, 'changed' holds the squares whose occupancy
+/// changed, so that also sliders whose attacks cross them are recomputed.
+
+void Position::update_attacks(int dirty, Bitboard changed) {
+
+  for (Color c = WHITE; c <= BLACK; c++)
+  {
+      for (PieceType pt = BISHOP; pt <= QUEEN; pt++)
+          if (st->attacks[c][pt] & changed)
+              dirty |= attack_map_bit(c, pt);
+
+      if (!(dirty & (0xFF << (8 * int(c)))))
+          continue;
+
+      st->attacks[c][0] = EmptyBoardBB;
+
+      for (PieceType pt = PAWN; pt <= KING; pt++)
+      {
+          if (dirty & attack_map_bit(c, pt))
+              st->attacks[c][pt] = compute_attacks(c, pt);
+
+          st->attacks[c][0] |= st->attacks[c][pt];
+      }
+  }
+}
+
+#endif
+
+
 /// Position::pl_move_is_legal() tests whether a pseudo-legal move is legal
 
 bool Position::pl_move_is_legal(Move m, Bitboard pinned) const {
@@ -546,7 +617,7 @@ bool Position::pl_move_is_legal(Move m, Bitboard pinned) const {
   // If the moving piece is a king, check whether the destination
   // square is attacked by the opponent.
   if (type_of_piece_on(from) == KING)
-      return !(attackers_to(move_to(m)) & pieces_of_color(opposite_color(us)));
+      return !square_is_attacked(move_to(m), opposite_color(us));
 
   // A non-king move is legal if and only if it is not pinned or it
   // is moving along the ray towards or away from the king.
@@ -713,6 +784,10 @@ void Position::do_move(Move m, StateInfo& newSt, const CheckInfo& ci, bool moveI
   newSt.previous = st;
   st = &newSt;
 
+#if defined(USE_ATTACK_MAPS)
+  memcpy(st->attacks, st->previous->attacks, sizeof(st->attacks));
+#endif
+
   // Save the current key to the history[] array, in order to be able to
   // detect repetition draws.
   history[st->gamePly++] = key;
@@ -883,6 +958,29 @@ void Position::do_move(Move m, StateInfo& newSt, const CheckInfo& ci, bool moveI
       }
   }
 
+#if defined(USE_ATTACK_MAPS)
+  // Update attack maps. Besides the moving and captured piece sets, the
+  // sliders crossing the squares emptied or newly filled must be refreshed.
+  {
+      int dirty = attack_map_bit(us, pt);
+      Bitboard changed = SetMaskBB[from];
+
+      if (pm)
+          dirty |= attack_map_bit(us, move_promotion_piece(m));
+
+      if (capture)
+          dirty |= attack_map_bit(them, capture);
+
+      if (!capture || ep)
+          changed |= SetMaskBB[to];
+
+      if (ep)
+          changed |= SetMaskBB[to - pawn_push(us)];
+
+      update_attacks(dirty, changed);
+  }
+#endif
+
   // Finish
   sideToMove = opposite_color(sideToMove);
   st->value += (sideToMove == WHITE ?  TempoValue : -TempoValue);
@@ -1044,6 +1142,12 @@ void Position::do_castle_move(Move m) {
   // Update checkers BB
   st->checkersBB = attackers_to(king_square(them)) & pieces_of_color(us);
 
+#if defined(USE_ATTACK_MAPS)
+  // Update attack maps
+  update_attacks(attack_map_bit(us, KING) | attack_map_bit(us, ROOK),
+                 SetMaskBB[kfrom] | SetMaskBB[kto] | SetMaskBB[rfrom] | SetMaskBB[rto]);
+#endif
+
   // Finish
   sideToMove = opposite_color(sideToMove);
   st->value += (sideToMove == WHITE ?  TempoValue : -TempoValue);
@@ -1345,6 +1449,18 @@ int Position::see(Square from, Square to) const {
   if (type_of_piece(piece) == KING)
       return seeValues[capture];
 
+#if defined(USE_ATTACK_MAPS)
+  // If the destination square is not defended and there is no enemy slider
+  // behind the moving piece that could be discovered, the capture is free.
+  if (   from != SQ_NONE
+      && to != st->epSquare
+      && !bit_is_set(attacked_by(them), to)
+      && !bit_is_set(  attacked_by(them, BISHOP)
+                     | attacked_by(them, ROOK)
+                     | attacked_by(them, QUEEN), from))
+      return seeValues[capture];
+#endif
+
   // Handle en passant moves
   if (st->epSquare == to && type_of_piece_on(from) == PAWN)
   {
@@ -1820,6 +1936,11 @@ void Position::flipped_copy(const Position& pos) {
   // Checkers
   find_checkers();
 
+#if defined(USE_ATTACK_MAPS)
+  // Attack maps
+  update_attacks(AllAttackMaps, EmptyBoardBB);
+#endif
+
   // Hash keys
   st->key = compute_key();
   st->pawnKey = compute_pawn_key();
@@ -1854,6 +1975,9 @@ bool Position::is_ok(int* failedStep) const {
   static const bool debugPieceCounts = false;
   static const bool debugPieceList = false;
   static const bool debugCastleSquares = false;
+#if defined(USE_ATTACK_MAPS)
+  static const bool debugAttackMaps = false;
+#endif
 
   if (failedStep) *failedStep = 1;
 
@@ -2009,6 +2133,26 @@ bool Position::is_ok(int* failedStep) const {
           return false;
   }
 
+#if defined(USE_ATTACK_MAPS)
+  if (failedStep) (*failedStep)++;
+  if (debugAttackMaps)
+  {
+      Bitboard all[2] = { EmptyBoardBB, EmptyBoardBB };
+
+      for (Color c = WHITE; c <= BLACK; c++)
+          for (PieceType pt = PAWN; pt <= KING; pt++)
+          {
+              if (st->attacks[c][pt] != compute_attacks(c, pt))
+                  return false;
+
+              all[c] |= st->attacks[c][pt];
+          }
+
+      if (all[WHITE] != st->attacks[WHITE][0] || all[BLACK] != st->attacks[BLACK][0])
+          return false;
+  }
+#endif
+
   if (failedStep) *failedStep = 0;
   return true;
 }
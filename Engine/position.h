@@ -109,6 +109,9 @@ struct StateInfo {
   Key key;
   Bitboard checkersBB;
   StateInfo* previous;
+#if defined(USE_ATTACK_MAPS)
+  Bitboard attacks[2][8]; // Attacked squares by color and piece type, all types at index 0
+#endif
 };
 
 
@@ -215,6 +218,11 @@ public:
   Bitboard attacks_from(Piece p, Square s) const;
   template<PieceType> Bitboard attacks_from(Square s) const;
   template<PieceType> Bitboard attacks_from(Square s, Color c) const;
+  bool square_is_attacked(Square s, Color c) const;
+#if defined(USE_ATTACK_MAPS)
+  Bitboard attacked_by(Color c) const;
+  Bitboard attacked_by(Color c, PieceType pt) const;
+#endif
 
   // Properties of moves
   bool pl_move_is_legal(Move m, Bitboard pinned) const;
@@ -298,6 +306,10 @@ private:
   // Helper functions for doing and undoing moves
   void do_capture_move(Key& key, PieceType capture, Color them, Square to, bool ep);
   void do_castle_move(Move m);
+#if defined(USE_ATTACK_MAPS)
+  void update_attacks(int dirty, Bitboard changed);
+  Bitboard compute_attacks(Color c, PieceType pt) const;
+#endif
   void undo_castle_move(Move m);
   void find_checkers();
 
@@ -475,6 +487,24 @@ inline Bitboard Position::attacks_from<QUEEN>(Square s) const {
   return attacks_from<ROOK>(s) | attacks_from<BISHOP>(s);
 }
 
+inline bool Position::square_is_attacked(Square s, Color c) const {
+#if defined(USE_ATTACK_MAPS)
+  return bit_is_set(st->attacks[c][0], s);
+#else
+  return attackers_to(s) & pieces_of_color(c);
+#endif
+}
+
+#if defined(USE_ATTACK_MAPS)
+inline Bitboard Position::attacked_by(Color c) const {
+  return st->attacks[c][0];
+}
+
+inline Bitboard Position::attacked_by(Color c, PieceType pt) const {
+  return st->attacks[c][pt];
+}
+#endif
+
 inline Bitboard Position::checkers() const {
   return st->checkersBB;
 }
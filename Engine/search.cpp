@@ -17,17 +17,31 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// To collect search tree statistics, printed after each iteration,
+// uncomment following line
+//#define SEARCH_STATS
+
 
 ////
 //// Includes
 ////
 
+#if !defined(_MSC_VER)
+#  include <time.h>
+#  include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cmath>
+#include <cstddef>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <new>
 #include <sstream>
 
 #include "bitcount.h"
@@ -52,6 +66,8 @@ using std::endl;
 //// Local definitions
 ////
 
+class SearchContext;
+
 namespace {
 
   /// Types
@@ -65,17 +81,23 @@ namespace {
   // init, starting, parking and, the most important, launching a slave thread at a
   // split point are what this class does. All the access to shared thread data is
   // done through this class, so that we avoid using global variables instead.
+  // Each search context has its own ThreadsManager, that runs the search on a
+  // slice of the global Threads[] array, from FirstThread on. Thread IDs are
+  // indices in that array, so they are unique among all the contexts.
 
   class ThreadsManager {
-    /* As long as the single ThreadsManager object is defined as a global we don't
-       need to explicitly initialize to zero its data members because variables with
-       static storage duration are automatically set to zero before enter main()
-    */
+
   public:
-    void init_threads();
+    ThreadsManager(SearchContext* owner);
+    void init_threads(int threadsCount);
     void exit_threads();
+    void init_thread_data(int threadID);
+    bool bind_threads() const { return BindThreads; }
 
+    int main_thread() const { return FirstThread; }
     int active_threads() const { return ActiveThreads; }
+    int threads_count() const { return ThreadsCount; }
+    bool thread_is_active(int threadID) const { return threadID >= FirstThread && threadID < FirstThread + ActiveThreads; }
     void set_active_threads(int newActiveThreads) { ActiveThreads = newActiveThreads; }
     void incrementNodeCounter(int threadID) { threads[threadID].nodes++; }
     void incrementBetaCounter(Color us, Depth d, int threadID) { threads[threadID].betaCutOffs[us] += unsigned(d); }
@@ -84,11 +106,19 @@ namespace {
     void resetBetaCounters();
     int64_t nodes_searched() const;
     void get_beta_counters(Color us, int64_t& our, int64_t& their) const;
+    void get_split_latency(int64_t& joins, int64_t& joinTime) const;
+    void get_thread_stats(int threadID, int64_t& nodes, int64_t& lateJoins, int64_t& idleTime) const;
+    void print_thread_stats(std::ostream& os) const;
     bool available_thread_exists(int master) const;
     bool thread_is_available(int slave, int master) const;
     bool thread_should_stop(int threadID) const;
     void wake_sleeping_threads();
+    void wake_thread(int threadID);
     void put_threads_to_sleep();
+    void start_helpers(const Position* pos);
+    void wait_for_helpers() const;
+    bool helpers_finished() const;
+    bool help_split_point(int threadID);
     void idle_loop(int threadID, SplitPoint* sp);
 
     template <bool Fake>
@@ -96,21 +126,18 @@ namespace {
                Depth depth, bool mateThreat, int* moveCount, MovePicker* mp, bool pvNode);
 
   private:
-    friend void poll();
+    bool split_point_finished(const SplitPoint* sp) const;
+    SplitPoint* join_split_point(int threadID);
+    bool should_wake_up(int threadID, const SplitPoint* sp) const;
+    void park(int threadID, const SplitPoint* sp);
 
-    int ActiveThreads;
+    SearchContext* Owner;
+    int FirstThread, ActiveThreads, ThreadsCount;
     volatile bool AllThreadsShouldExit, AllThreadsShouldSleep;
-    Thread threads[MAX_THREADS];
-    SplitPoint SplitPointStack[MAX_THREADS][ACTIVE_SPLIT_POINTS_MAX];
-
-    Lock MPLock, WaitLock;
-
-#if !defined(_MSC_VER)
-    pthread_cond_t WaitCond;
-#else
-    HANDLE SitIdleEvent[MAX_THREADS];
-#endif
-
+    const Position* volatile HelpersRootPosition;
+    Thread* threads;
+    SplitPoint* SplitPointStack[MAX_THREADS]; // Allocated by each thread, see init_thread_data()
+    bool BindThreads;
   };
 
 
@@ -144,7 +171,7 @@ namespace {
   class RootMoveList {
 
   public:
-    RootMoveList(Position& pos, Move searchMoves[]);
+    RootMoveList(SearchContext* ctx, Position& pos, Move searchMoves[]);
 
     int move_count() const { return count; }
     Move get_move(int moveNum) const { return moves[moveNum].move; }
@@ -196,10 +223,7 @@ namespace {
 
   // Step 11. Decide the new search depth
 
-  // Extensions. Configurable UCI options
-  // Array index 0 is used at non-PV nodes, index 1 at PV nodes.
-  Depth CheckExtension[2], SingleEvasionExtension[2], PawnPushTo7thExtension[2];
-  Depth PassedPawnExtension[2], PawnEndgameExtension[2], MateThreatExtension[2];
+  // Extensions are configurable UCI options, see SearchContext
 
   // Minimum depth for use of singular extension
   const Depth SingularExtensionDepth[2] = { 8 * OnePly /* non-PV */, 6 * OnePly /* PV */};
@@ -241,19 +265,206 @@ namespace {
   const bool UseLSNFiltering = false;
   const int LSNTime = 100; // In milliseconds
   const Value LSNValue = value_from_centipawns(200);
-  bool loseOnTime = false;
 
-  // Adjustable playing strength
-  int Slowdown = 0;
-  const int SlowdownArray[14] = {
-     14, 30, 46, 70, 115, 170, 240, 330, 453, 610, 793, 1027, 1284, 1605
+  // The timer thread of a search checks the time limits and asks the main
+  // thread to poll for input every PollPeriod milliseconds.
+  const int PollPeriod = 5;
+
+  // Adjustable playing strength. SlowdownBusy[] is the share of the time, in
+  // per mille, a slowed down thread spends searching at each level. It is
+  // tuned so that the node rate matches the one of the old CPU burning loop
+  // at that level, waking up from a sleep costs about a fifth of the speed.
+  // A slowed down thread checks its speed every SlowdownBatch nodes and
+  // sleeps SlowdownMaxSleep microseconds at most between two checks for a
+  // stop.
+  const int SlowdownBusy[14] = {
+     974, 883, 691, 576, 461, 358, 294, 237, 180, 148, 118, 83, 74, 63
   };
   const int MaxStrength = 25;
-  int Blunder = 0;
+  const int SlowdownBatch = 2048;
+  const int SlowdownMaxSleep = 4000;
 
 
   /// Global variables
 
+  // Multi-threads related variables. An idle thread polls for work this many
+  // times before to park itself until it is woken up.
+  const int IdleSpinCount = 1 << 12;
+
+  // In Lazy SMP mode helper threads skip some iterations so that not all
+  // of them search at the same depth. Helper i, counted from the main thread
+  // of its context, uses the pattern at index (i - 1) % LazySkipSize and
+  // skips depth d if ((d + phase) / size) is odd.
+  const int LazySkipSize = 20;
+  const int LazySkipDepths[LazySkipSize] = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+  const int LazySkipPhases[LazySkipSize] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+  // The threads of all the search contexts. Each context books a slice of
+  // them when it launches its threads, ThreadOwner[] is protected by
+  // ThreadOwnerLock.
+  Thread Threads[MAX_THREADS];
+  ThreadsManager* ThreadOwner[MAX_THREADS];
+  Lock ThreadOwnerLock;
+
+  // The context of the UCI searches
+  SearchContext* DefaultContext;
+
+  // Search tree statistics, counted by each thread when SEARCH_STATS is
+  // defined and printed by print_search_stats(). Nodes are counted by depth,
+  // in plies, and by ply, the last slot collecting all the deeper ones.
+  const int StatsDepths = 32;
+  const int StatsPlies = 64;
+
+  struct SearchStats {
+    uint64_t nodesByDepth[StatsDepths], nodesByPly[StatsPlies], qnodes;
+    uint64_t ttProbes, ttCutoffs, cutoffs, firstMoveCutoffs;
+    uint64_t nullTries, nullCutoffs, razorTries, razorCutoffs, staticNullPrunes;
+    uint64_t moveCountPrunes, futilityPrunes, reductions, reSearches, pvReSearches;
+    unsigned char pad[64];
+  };
+
+#if defined(SEARCH_STATS)
+  SearchStats Stats[MAX_THREADS];
+#  define SEARCH_STAT(t, s) (Stats[t].s++)
+#  define SEARCH_STAT_ADD(t, s, n) (Stats[t].s += (n))
+#else
+#  define SEARCH_STAT(t, s)
+#  define SEARCH_STAT_ADD(t, s, n)
+#endif
+
+  // Perft hash table entry. The key is stored xor-ed with the data, so that
+  // an entry torn by a concurrent write is seen as a miss.
+  struct PerftEntry {
+    Key check;
+    uint64_t data; // (node count << 8) | depth in plies
+  };
+
+  // The threads of perft() share its hash table and take the root moves one
+  // at a time, PerftNextMove is protected by PerftLock.
+  PerftEntry* PerftTable;
+  uint64_t PerftTableMask;
+  const Position* PerftRoot;
+  int PerftDepth, PerftMovesCount, PerftNextMove;
+  MoveStack PerftMoves[256];
+  int64_t PerftCounts[256];
+  Lock PerftLock;
+
+  /// Local functions
+
+  bool connected_moves(const Position& pos, Move m1, Move m2);
+  bool value_is_mate(Value value);
+  bool move_is_killer(Move m, SearchStack* ss);
+  bool ok_to_use_TT(const TTEntry* tte, Depth depth, Value beta, int ply);
+  bool connected_threat(const Position& pos, Move m, Move threat);
+  Value refine_eval(const TTEntry* tte, Value defaultEval, int ply);
+  void update_killers(Move m, SearchStack* ss);
+  void init_ss_array(SearchStack* ss, int size);
+  int64_t perft_count(Position& pos, int depth);
+  void perft_loop(int threadID);
+
+#if !defined(_MSC_VER)
+  void *init_thread(void *threadID);
+  void *perft_thread(void *threadID);
+  void *timer_thread(void *ctx);
+#else
+  DWORD WINAPI init_thread(LPVOID threadID);
+  DWORD WINAPI perft_thread(LPVOID threadID);
+  DWORD WINAPI timer_thread(LPVOID ctx);
+#endif
+
+}
+
+
+// SearchContext class keeps all the state of a search: the threads running
+// it, the iteration and time management variables, the history table and
+// the UCI option values read when the search starts. Only the lookup tables
+// set up by init_search() and the transposition table are shared, so that
+// several contexts can search at the same time on different positions.
+//
+// The primary context is the one driven by the UCI loop. It is the only one
+// that reads commands and prints information while searching, and that sets
+// process wide things: the hash size, the opening book and the evaluation
+// parameters. Other contexts are stopped with stop_search(), report through
+// get_search_result() and their threads count is fixed when they are created.
+// The class is private to this file, so there is no point in hiding its
+// members from ThreadsManager behind accessors.
+
+class SearchContext {
+
+public:
+  SearchContext(bool primary, TranspositionTable& tt);
+  ~SearchContext();
+
+  bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
+             int time[], int increment[], int movesToGo, int maxDepth,
+             int maxNodes, int maxTime, Move searchMoves[]);
+
+  Value id_loop(const Position& pos, Move searchMoves[]);
+  void helper_id_loop(const Position& pos, int threadID);
+  Value root_search(Position& pos, SearchStack* ss, Move* pv, RootMoveList& rml, Value* alphaPtr, Value* betaPtr);
+  Value parallel_root_search(Position& pos, SearchStack* ss, Move* pv, RootMoveList& rml);
+  void multipv_worker(const Position& pos, int threadID);
+  Value multipv_bound() const;
+  void print_multipv();
+
+  template <NodeType PvNode>
+  Value search(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply);
+
+  template <NodeType PvNode>
+  Value qsearch(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply);
+
+  template <NodeType PvNode>
+  void sp_search(SplitPoint* sp, int threadID);
+
+  template <NodeType PvNode>
+  Depth extension(const Position& pos, Move m, bool captureOrPromotion, bool moveIsCheck, bool singleEvasion, bool mateThreat, bool* dangerous);
+
+  void update_history(const Position& pos, Move move, Depth depth, Move movesSearched[], int moveCount);
+  void update_gains(const Position& pos, Move move, Value before, Value after);
+  void slowdown(const Position& pos);
+
+  int current_search_time();
+  int nps();
+  void poll();
+  void check_limits();
+  void start_timer();
+  void stop_timer();
+  void timer_loop();
+  int timer_wait();
+  void ponderhit();
+  void wait_for_stop_or_ponderhit();
+  void print_pv_info(const Position& pos, Move pv[], Value alpha, Value beta, Value value);
+  void print_search_stats();
+
+  const bool Primary;
+
+  // The transposition table of the context, it hides the global one in the
+  // member functions. Usually it is the global one, but it can be private.
+  TranspositionTable& TT;
+
+  // Search information goes to the standard output for the primary context
+  // and is thrown away by the others.
+  std::ostream NullOut;
+  std::ostream& Out;
+
+  // Outcome of the last search
+  SearchResult Result;
+
+  // Extensions. Configurable UCI options
+  // Array index 0 is used at non-PV nodes, index 1 at PV nodes.
+  Depth CheckExtension[2], SingleEvasionExtension[2], PawnPushTo7thExtension[2];
+  Depth PassedPawnExtension[2], PawnEndgameExtension[2], MateThreatExtension[2];
+
+  // Last seconds noise filtering (LSN)
+  bool loseOnTime;
+
+  // Adjustable playing strength. Slowdown is the busy share of SlowdownBusy[],
+  // zero at full speed.
+  int Slowdown, Blunder;
+
+  // Evaluation settings, used by all the threads of the context
+  EvalParams Params;
+
   // Iteration counter
   int Iteration;
 
@@ -264,8 +475,19 @@ namespace {
   // Search window management
   int AspirationDelta;
 
-  // MultiPV mode
+  // MultiPV mode. In parallel MultiPV mode all the threads pick root moves
+  // from RootMoves[], see multipv_worker(). RootMoveDone[] flags the moves
+  // searched at the current iteration, RootWorkers counts the threads still
+  // in multipv_worker(). Protected by RootLock.
   int MultiPV;
+  bool ParallelMultiPV;
+  Lock RootLock;
+  RootMoveList* RootMoves;
+  Depth RootDepth;
+  Value RootEval;
+  int RootNextMove;
+  bool RootMoveDone[256];
+  volatile int RootWorkers;
 
   // Time managment variables
   int SearchStartTime, MaxNodes, MaxDepth, MaxSearchTime;
@@ -280,71 +502,137 @@ namespace {
   // Multi-threads related variables
   Depth MinimumSplitDepth;
   int MaxThreadsPerSplitPoint;
+  bool LazySMP;
   ThreadsManager TM;
 
-  // Node counters, used only by thread[0] but try to keep in different cache
-  // lines (64 bytes each) from the heavy multi-thread read accessed variables.
+  // Node counters, used only by the main thread of the context but try to
+  // keep in different cache lines (64 bytes each) from the heavy multi-thread
+  // read accessed variables. Nodes are counted only for node limited searches,
+  // otherwise the timer thread sets PollRequested.
   int NodesSincePoll;
-  int NodesBetweenPolls = 30000;
+  int NodesBetweenPolls;
+  int LastInfoTime;
+  volatile bool PollRequested;
+
+  // Timer thread, see timer_loop()
+  volatile bool TimerStop;
+  bool TimerStarted;
+  Lock TimerLock;
+#if !defined(_MSC_VER)
+  pthread_t TimerThread;
+  pthread_cond_t TimerCond;
+#else
+  HANDLE TimerThread;
+  HANDLE TimerEvent;
+#endif
+
+  // The other contexts wait for stop_search() here when pondering, see
+  // wait_for_stop_or_ponderhit()
+  Lock StopLock;
+#if !defined(_MSC_VER)
+  pthread_cond_t StopCond;
+#else
+  HANDLE StopEvent;
+#endif
 
   // History table
   History H;
+};
 
-  /// Local functions
 
-  Value id_loop(const Position& pos, Move searchMoves[]);
-  Value root_search(Position& pos, SearchStack* ss, Move* pv, RootMoveList& rml, Value* alphaPtr, Value* betaPtr);
+////
+//// Functions
+////
 
-  template <NodeType PvNode>
-  Value search(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply);
+/// init_threads(), exit_threads(), nodes_searched(), split_latency() and
+/// thread_stats() are helpers to give accessibility to some TM methods of
+/// the default search context from outside of current file.
 
-  template <NodeType PvNode>
-  Value qsearch(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply);
+void init_threads() { DefaultContext->TM.init_threads(Max(get_option_value_int("Threads"), 1)); }
+void exit_threads() { DefaultContext->TM.exit_threads(); }
+int64_t nodes_searched() { return DefaultContext->TM.nodes_searched(); }
+void split_latency(int64_t& joins, int64_t& joinTime) { DefaultContext->TM.get_split_latency(joins, joinTime); }
+void thread_stats(int threadID, int64_t& nodes, int64_t& lateJoins, int64_t& idleTime) { DefaultContext->TM.get_thread_stats(threadID, nodes, lateJoins, idleTime); }
 
-  template <NodeType PvNode>
-  void sp_search(SplitPoint* sp, int threadID);
 
-  template <NodeType PvNode>
-  Depth extension(const Position& pos, Move m, bool captureOrPromotion, bool moveIsCheck, bool singleEvasion, bool mateThreat, bool* dangerous);
+/// new_search_context() creates a search context that runs with the given
+/// number of threads, fewer if not enough of them are free, independently
+/// from the UCI searches. It uses the given transposition table, or the
+/// global one when table is NULL. delete_search_context() stops its threads
+/// and frees it, it must not be searching.
 
-  bool connected_moves(const Position& pos, Move m1, Move m2);
-  bool value_is_mate(Value value);
-  bool move_is_killer(Move m, SearchStack* ss);
-  bool ok_to_use_TT(const TTEntry* tte, Depth depth, Value beta, int ply);
-  bool connected_threat(const Position& pos, Move m, Move threat);
-  Value refine_eval(const TTEntry* tte, Value defaultEval, int ply);
-  void update_history(const Position& pos, Move move, Depth depth, Move movesSearched[], int moveCount);
-  void update_killers(Move m, SearchStack* ss);
-  void update_gains(const Position& pos, Move move, Value before, Value after);
-  void slowdown(const Position &pos);
+SearchContext* new_search_context(int threadsCount, TranspositionTable* table) {
+
+  SearchContext* ctx = new SearchContext(false, table ? *table : TT);
+  ctx->TM.init_threads(Max(threadsCount, 1));
+  return ctx;
+}
+
+void delete_search_context(SearchContext* ctx) {
+
+  ctx->TM.exit_threads();
+  delete ctx;
+}
 
-  int current_search_time();
-  int nps();
-  void poll();
-  void ponderhit();
-  void wait_for_stop_or_ponderhit();
-  void init_ss_array(SearchStack* ss, int size);
-  void print_pv_info(const Position& pos, Move pv[], Value alpha, Value beta, Value value);
+
+/// available_threads() returns how many threads are not used by any search
+/// context, that is how many more threads new_search_context() can launch.
+
+int available_threads() {
+
+  int cnt = 0;
+
+  lock_grab(&ThreadOwnerLock);
+
+  for (int i = 0; i < MAX_THREADS; i++)
+      cnt += !ThreadOwner[i];
+
+  lock_release(&ThreadOwnerLock);
+
+  return cnt;
+}
+
+
+/// get_search_result() returns the outcome of the last search of a context:
+/// the principal variation, its score, the depth of the last completed
+/// iteration, and the nodes and time spent.
+
+void get_search_result(SearchContext* ctx, SearchResult& result) {
+
+  result = ctx->Result;
+}
+
+
+/// stop_search() asks the search running in the given context to stop as
+/// soon as possible. It can be called from any thread.
+
+void stop_search(SearchContext* ctx) {
+
+  lock_grab(&ctx->StopLock);
+
+  ctx->PonderSearch = false;
+  ctx->AbortSearch = true;
 
 #if !defined(_MSC_VER)
-  void *init_thread(void *threadID);
+  pthread_cond_signal(&ctx->StopCond);
 #else
-  DWORD WINAPI init_thread(LPVOID threadID);
+  SetEvent(ctx->StopEvent);
 #endif
 
+  lock_release(&ctx->StopLock);
 }
 
 
-////
-//// Functions
-////
+/// think() with a search context searches in that context, the same way as
+/// think() below does for the UCI searches, except that input is not read.
 
-/// init_threads(), exit_threads() and nodes_searched() are helpers to
-/// give accessibility to some TM methods from outside of current file.
+bool think(SearchContext* ctx, const Position& pos, bool infinite, bool ponder, int side_to_move,
+           int time[], int increment[], int movesToGo, int maxDepth,
+           int maxNodes, int maxTime, Move searchMoves[]) {
 
-void init_threads() { TM.init_threads(); }
-void exit_threads() { TM.exit_threads(); }
-int64_t nodes_searched() { return TM.nodes_searched(); }
+  return ctx->think(pos, infinite, ponder, side_to_move, time, increment,
+                    movesToGo, maxDepth, maxNodes, maxTime, searchMoves);
+}
 
 
 /// init_search() is called during startup. It initializes various lookup tables
@@ -371,6 +659,9 @@ void init_search() {
   // Init futility move count array
   for (d = 0; d < 32; d++)
       FutilityMoveCountArray[d] = 3 + (1 << (3 * d / 8));
+
+  lock_init(&ThreadOwnerLock, NULL);
+  DefaultContext = new SearchContext(true, TT);
 }
 
 
@@ -381,6 +672,7 @@ void SearchStack::init() {
   currentMove = threatMove = bestMove = MOVE_NONE;
   reduction = Depth(0);
   eval = VALUE_NONE;
+  lazyEval = false;
 }
 
 // SearchStack::initKillers() initializes killers for a search stack entry
@@ -394,49 +686,147 @@ void SearchStack::initKillers() {
 
 /// perft() is our utility to verify move generation is bug free. All the legal
 /// moves up to given depth are generated and counted and the sum returned.
+/// Moves at the last ply are only counted, the counts of the subtrees are
+/// cached in a hash table of "Hash" MB and the root moves are shared among
+/// "Threads" threads. With divide the count of each root move is printed.
 
-int perft(Position& pos, Depth depth)
-{
-    StateInfo st;
-    Move move;
-    int sum = 0;
-    MovePicker mp(pos, MOVE_NONE, depth, H);
+int64_t perft(Position& pos, Depth depth, bool divide) {
 
-    // If we are at the last ply we don't need to do and undo
-    // the moves, just to count them.
-    if (depth <= OnePly) // Replace with '<' to test also qsearch
-    {
-        while (mp.get_next_move()) sum++;
-        return sum;
-    }
+#if !defined(_MSC_VER)
+  pthread_t handles[MAX_THREADS];
+#else
+  HANDLE handles[MAX_THREADS];
+#endif
 
-    // Loop through all legal moves
-    CheckInfo ci(pos);
-    while ((move = mp.get_next_move()) != MOVE_NONE)
-    {
-        pos.do_move(move, st, ci, pos.move_is_check(move, ci));
-        sum += perft(pos, depth - OnePly);
-        pos.undo_move(move);
-    }
-    return sum;
+  int64_t sum = 0;
+
+  PerftRoot = &pos;
+  PerftDepth = Max(depth / OnePly, 1);
+  PerftMovesCount = int(generate_moves(pos, PerftMoves) - PerftMoves);
+  PerftNextMove = 0;
+  PerftTable = NULL;
+
+  // No hash is needed when all the moves are counted without being made
+  if (PerftDepth > 2)
+  {
+      uint64_t size = 1, bytes = uint64_t(get_option_value_int("Hash")) << 20;
+
+      while (2 * size * sizeof(PerftEntry) <= bytes)
+          size *= 2;
+
+      // Without memory we just go slower
+      PerftTable = new (std::nothrow) PerftEntry[size];
+      PerftTableMask = size - 1;
+
+      if (PerftTable)
+          memset(PerftTable, 0, size * sizeof(PerftEntry));
+  }
+
+  int threads = Max(1, Min(Min(get_option_value_int("Threads"), MAX_THREADS), PerftMovesCount));
+  lock_init(&PerftLock, NULL);
+
+  // The calling thread works as thread 0, the others are launched here
+  for (int i = 1; i < threads; i++)
+  {
+#if !defined(_MSC_VER)
+      bool ok = (pthread_create(&handles[i], NULL, perft_thread, (void*)intptr_t(i)) == 0);
+#else
+      bool ok = ((handles[i] = CreateThread(NULL, 0, perft_thread, (LPVOID)intptr_t(i), 0, NULL)) != NULL);
+#endif
+      if (!ok)
+      {
+          cout << "Failed to create thread number " << i << endl;
+          Application::exit_with_failure();
+      }
+  }
+
+  perft_loop(0);
+
+  for (int i = 1; i < threads; i++)
+  {
+#if !defined(_MSC_VER)
+      pthread_join(handles[i], NULL);
+#else
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+#endif
+  }
+
+  lock_destroy(&PerftLock);
+  delete [] PerftTable;
+  PerftTable = NULL;
+
+  for (int i = 0; i < PerftMovesCount; i++)
+  {
+      sum += PerftCounts[i];
+
+      if (divide)
+          cout << PerftMoves[i].move << ' ' << PerftCounts[i] << endl;
+  }
+  return sum;
 }
 
 
 /// think() is the external interface to Stockfish's search, and is called when
-/// the program receives the UCI 'go' command. It initializes various
-/// search-related global variables, and calls root_search(). It returns false
-/// when a quit command is received during the search.
+/// the program receives the UCI 'go' command. It searches in the default
+/// context and returns false when a quit command is received during the search.
 
 bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
            int time[], int increment[], int movesToGo, int maxDepth,
            int maxNodes, int maxTime, Move searchMoves[]) {
 
-  // Initialize global search variables
+  return DefaultContext->think(pos, infinite, ponder, side_to_move, time, increment,
+                               movesToGo, maxDepth, maxNodes, maxTime, searchMoves);
+}
+
+
+/// SearchContext c'tor. Threads are launched later, by init_threads().
+
+SearchContext::SearchContext(bool primary, TranspositionTable& tt)
+  : Primary(primary), TT(tt), NullOut(NULL), Out(primary ? cout : NullOut), TM(this) {
+
+  loseOnTime = false;
+  Slowdown = Blunder = 0;
+  NodesBetweenPolls = INT_MAX;
+  LastInfoTime = 0;
+  PollRequested = TimerStarted = false;
+  lock_init(&RootLock, NULL);
+  lock_init(&StopLock, NULL);
+
+#if !defined(_MSC_VER)
+  pthread_cond_init(&StopCond, NULL);
+#else
+  StopEvent = CreateEvent(0, FALSE, FALSE, 0);
+#endif
+}
+
+SearchContext::~SearchContext() {
+
+#if !defined(_MSC_VER)
+  pthread_cond_destroy(&StopCond);
+#else
+  CloseHandle(StopEvent);
+#endif
+
+  lock_destroy(&StopLock);
+  lock_destroy(&RootLock);
+}
+
+
+/// SearchContext::think() initializes the search variables of the context,
+/// reading the UCI options, and calls id_loop().
+
+bool SearchContext::think(const Position& pos, bool infinite, bool ponder, int side_to_move,
+                          int time[], int increment[], int movesToGo, int maxDepth,
+                          int maxNodes, int maxTime, Move searchMoves[]) {
+
+  // Initialize search variables
   StopOnPonderhit = AbortSearch = Quit = AspirationFailLow = false;
   MaxSearchTime = AbsoluteMaxSearchTime = ExtraSearchTime = 0;
   NodesSincePoll = 0;
+  PollRequested = false;
   TM.resetNodeCounters();
-  SearchStartTime = get_system_time();
+  SearchStartTime = get_monotonic_time();
   ExactMaxTime = maxTime;
   MaxDepth = maxDepth;
   MaxNodes = maxNodes;
@@ -445,7 +835,7 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
   UseTimeManagement = !ExactMaxTime && !MaxDepth && !MaxNodes && !InfiniteSearch;
 
   // Look for a book move, only during games, not tests
-  if (UseTimeManagement && get_option_value_bool("OwnBook"))
+  if (Primary && UseTimeManagement && get_option_value_bool("OwnBook"))
   {
       if (get_option_value_string("Book File") != OpeningBook.file_name())
           OpeningBook.open(get_option_value_string("Book File"));
@@ -461,15 +851,22 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
       }
   }
 
-  // Reset loseOnTime flag at the beginning of a new game
-  if (button_was_pressed("New Game"))
-      loseOnTime = false;
+  // Reset loseOnTime flag at the beginning of a new game. The hash table
+  // and the evaluation caches are sized only by the primary context, when
+  // no other can use them.
+  if (Primary)
+  {
+      if (button_was_pressed("New Game"))
+          loseOnTime = false;
 
-  // Read UCI option values
-  TT.set_size(get_option_value_int("Hash"));
-  if (button_was_pressed("Clear Hash"))
-      TT.clear();
+      TT.set_size(get_option_value_int("Hash"));
+      if (button_was_pressed("Clear Hash"))
+          TT.clear();
+
+      set_eval_cache_size(get_option_value_int("Eval Cache"));
+  }
 
+  // Read UCI option values
   CheckExtension[1]         = Depth(get_option_value_int("Check Extension (PV nodes)"));
   CheckExtension[0]         = Depth(get_option_value_int("Check Extension (non-PV nodes)"));
   SingleEvasionExtension[1] = Depth(get_option_value_int("Single Evasion Extension (PV nodes)"));
@@ -485,36 +882,53 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
 
   MinimumSplitDepth       = get_option_value_int("Minimum Split Depth") * OnePly;
   MaxThreadsPerSplitPoint = get_option_value_int("Maximum Number of Threads per Split Point");
+  LazySMP                 = (get_option_value_string("SMP Mode") == "Lazy SMP");
   MultiPV                 = get_option_value_int("MultiPV");
-  Chess960                = get_option_value_bool("UCI_Chess960");
-  UseLogFile              = get_option_value_bool("Use Search Log");
+  ParallelMultiPV         = MultiPV > 1 && !LazySMP && get_option_value_bool("Parallel MultiPV");
+  UseLogFile              = Primary && get_option_value_bool("Use Search Log");
 
   if (UseLogFile)
       LogFile.open(get_option_value_string("Search Log Filename").c_str(), std::ios::out | std::ios::app);
 
-  read_weights(pos.side_to_move());
+  // Set playing strength, the other contexts search at full strength. The
+  // strength is kept in the evaluation settings of this context only.
+  int strength = MaxStrength;
+  Slowdown = Blunder = 0;
 
-  // Set playing strength
-  if (get_option_value_bool("UCI_LimitStrength")
+  if (   Primary
+      && get_option_value_bool("UCI_LimitStrength")
       && !get_option_value_bool("UCI_AnalyseMode"))
   {
-      Strength = (get_option_value_int("UCI_Elo") - 2150) / 25;
+      strength = (get_option_value_int("UCI_Elo") - 2150) / 25;
       // Strength is now an integer in the range -66 .. 14
-      Blunder = 0;
-      if (Strength == MaxStrength) Slowdown = 0;
-      else if (Strength >= 0) Slowdown = SlowdownArray[Max(0, 13-Strength)];
-      else Slowdown = SlowdownArray[13], Blunder = (53+Strength)*(53+Strength);
-  }
-  else
-      Strength = MaxStrength, Slowdown = 0;
-  
-  // Set the number of active threads
-  int newActiveThreads = get_option_value_int("Threads");
-  if (newActiveThreads != TM.active_threads())
+      if (strength == MaxStrength) Slowdown = 0;
+      else if (strength >= 0) Slowdown = SlowdownBusy[Max(0, 13-strength)];
+      else Slowdown = SlowdownBusy[13], Blunder = (53+strength)*(53+strength);
+  }
+
+  // Read the evaluation weights. Chess960 is global because move strings
+  // depend on it, so only the primary context, driven by the GUI, sets it.
+  read_weights(Params, pos.side_to_move(), strength);
+
+  if (Primary)
+      Chess960 = Params.chess960;
+
+  // Set the number of active threads. Threads are all sleeping here, so we
+  // can safely relaunch a bigger pool if the new value exceeds the current
+  // one, or a pool with the new "Bind Threads" setting. The other contexts
+  // use all their threads.
+  int newActiveThreads = Primary ? get_option_value_int("Threads") : TM.threads_count();
+  if (   newActiveThreads > TM.threads_count()
+      || get_option_value_bool("Bind Threads") != TM.bind_threads())
   {
-      TM.set_active_threads(newActiveThreads);
-      init_eval(TM.active_threads());
+      TM.exit_threads();
+      TM.init_threads(newActiveThreads);
   }
+  TM.set_active_threads(Min(newActiveThreads, TM.threads_count()));
+
+  // All the threads of this context evaluate with its settings
+  for (int i = TM.main_thread(); i < TM.main_thread() + TM.threads_count(); i++)
+      set_eval_params(i, &Params);
 
   // Wake up sleeping threads
   TM.wake_sleeping_threads();
@@ -558,27 +972,9 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
       }
   }
 
-  // Set best NodesBetweenPolls interval to avoid lagging under
-  // heavy time pressure.
-  if (MaxNodes)
-      NodesBetweenPolls = Min(MaxNodes, 30000);
-  else if (myTime && myTime < 1000)
-      NodesBetweenPolls = 1000;
-  else if (myTime && myTime < 5000)
-      NodesBetweenPolls = 5000;
-  else
-      NodesBetweenPolls = 30000;
-
-#if defined(IPHONE_GLAURUNG)
-  if (Slowdown > 500)
-     NodesBetweenPolls = 1;
-  else if (Slowdown > 100)
-     NodesBetweenPolls = 5;
-  else if (Slowdown > 0)
-     NodesBetweenPolls = 20;
-  else
-     NodesBetweenPolls /= 30;
-#endif
+  // Polls are driven by the timer thread, the nodes are counted only to
+  // check the node limit.
+  NodesBetweenPolls = MaxNodes ? Min(MaxNodes, 30000) : INT_MAX;
 
   // Write search information to log file
   if (UseLogFile)
@@ -594,12 +990,14 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
       && loseOnTime)
   {
       // Step 2. If after last move we decided to lose on time, do it now!
-       while (SearchStartTime + myTime + 1000 > get_system_time())
+       while (SearchStartTime + myTime + 1000 > get_monotonic_time())
            /* wait here */;
   }
 
   // We're ready to start thinking. Call the iterative deepening loop function
+  start_timer();
   Value v = id_loop(pos, searchMoves);
+  stop_timer();
 
   if (UseLSNFiltering)
   {
@@ -629,23 +1027,27 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
 }
 
 
-namespace {
-
   // id_loop() is the main iterative deepening loop. It calls root_search
   // repeatedly with increasing depth until the allocated thinking time has
   // been consumed, the user stops the search, or the maximum search depth is
   // reached.
 
-  Value id_loop(const Position& pos, Move searchMoves[]) {
+  Value SearchContext::id_loop(const Position& pos, Move searchMoves[]) {
 
-    Position p(pos, pos.thread());
+    Position p(pos, TM.main_thread());
     SearchStack ss[PLY_MAX_PLUS_2];
     Move pv[PLY_MAX_PLUS_2];
     Move EasyMove = MOVE_NONE;
     Value value, alpha = -VALUE_INFINITE, beta = VALUE_INFINITE;
 
+    // The root moves are scored with a quiescence search, which uses the
+    // history. The other contexts search unrelated positions one after the
+    // other, so don't let the last search change the order of the moves.
+    if (!Primary)
+        H.clear();
+
     // Moves to search are verified, copied, scored and sorted
-    RootMoveList rml(p, searchMoves);
+    RootMoveList rml(this, p, searchMoves);
 
     // Handle special case of searching on a mate/stale position
     if (rml.move_count() == 0)
@@ -653,18 +1055,22 @@ namespace {
         if (PonderSearch)
             wait_for_stop_or_ponderhit();
 
-        return pos.is_check() ? -VALUE_MATE : VALUE_DRAW;
+        Result.pv[0] = MOVE_NONE;
+        Result.score = p.is_check() ? -VALUE_MATE : VALUE_DRAW;
+        Result.depth = 0;
+        Result.nodes = Result.time = 0;
+        return Result.score;
     }
 
     // Print RootMoveList startup scoring to the standard output,
     // so to output information also for iteration 1.
-    cout << "info depth " << 1
-         << "\ninfo depth " << 1
-         << " score " << value_to_string(rml.get_move_score(0))
-         << " time " << current_search_time()
-         << " nodes " << TM.nodes_searched()
-         << " nps " << nps()
-         << " pv " << rml.get_move(0) << "\n";
+    Out << "info depth " << 1
+        << "\ninfo depth " << 1
+        << " score " << value_to_string(rml.get_move_score(0))
+        << " time " << current_search_time()
+        << " nodes " << TM.nodes_searched()
+        << " nps " << nps()
+        << " pv " << rml.get_move(0) << "\n";
 
     // Initialize
     TT.new_search();
@@ -679,6 +1085,11 @@ namespace {
         || rml.get_move_score(0) > rml.get_move_score(1) + EasyMoveMargin)
         EasyMove = rml.get_move(0);
 
+    // In Lazy SMP mode let the helper threads start their own iterative
+    // deepening on the root position.
+    if (LazySMP && TM.active_threads() > 1)
+        TM.start_helpers(&pos);
+
     // Iterative deepening loop
     while (Iteration < PLY_MAX)
     {
@@ -686,7 +1097,11 @@ namespace {
         Iteration++;
         BestMoveChangesByIteration[Iteration] = 0;
 
-        cout << "info depth " << Iteration << endl;
+#if defined(SEARCH_STATS)
+        memset(Stats + TM.main_thread(), 0, TM.threads_count() * sizeof(SearchStats));
+#endif
+
+        Out << "info depth " << Iteration << endl;
 
         // Calculate dynamic aspiration window based on previous iterations
         if (MultiPV == 1 && Iteration >= 6 && abs(ValueByIteration[Iteration - 1]) < VALUE_KNOWN_WIN)
@@ -708,6 +1123,10 @@ namespace {
         // been overwritten during the search.
         TT.insert_pv(p, pv);
 
+#if defined(SEARCH_STATS)
+        print_search_stats();
+#endif
+
         if (AbortSearch)
             break; // Value cannot be trusted. Break out immediately!
 
@@ -768,16 +1187,26 @@ namespace {
             break;
     }
 
+    // The last iteration counts only if it has been completed
+    Result.depth = AbortSearch ? Iteration - 1 : Iteration;
+
     // If we are pondering or in infinite search, we shouldn't print the
     // best move before we are told to do so.
     if (!AbortSearch && (PonderSearch || InfiniteSearch))
         wait_for_stop_or_ponderhit();
     else
         // Print final search statistics
-        cout << "info nodes " << TM.nodes_searched()
-             << " nps " << nps()
-             << " time " << current_search_time()
-             << " hashfull " << TT.full() << endl;
+        Out << "info nodes " << TM.nodes_searched()
+            << " nps " << nps()
+            << " time " << current_search_time()
+            << " hashfull " << TT.full() << endl;
+
+    // Stop the helper threads, their work is only useful through the TT
+    if (LazySMP && TM.active_threads() > 1)
+    {
+        AbortSearch = true;
+        TM.wait_for_helpers();
+    }
 
     // Print the best move and the ponder move to the standard output
     if (pv[0] == MOVE_NONE)
@@ -788,15 +1217,21 @@ namespace {
 
     assert(pv[0] != MOVE_NONE);
 
-    cout << "bestmove " << pv[0];
+    Result.score = rml.get_move_score(0);
+    Result.nodes = TM.nodes_searched();
+    Result.time = current_search_time();
+    for (int i = 0; (Result.pv[i] = pv[i]) != MOVE_NONE; i++) {}
+
+    Out << "bestmove " << pv[0];
 
     if (pv[1] != MOVE_NONE)
-        cout << " ponder " << pv[1];
+        Out << " ponder " << pv[1];
 
-    cout << endl;
+    Out << endl;
 
 #if defined(IPHONE_GLAURUNG)
-    bestmove_to_ui(move_to_string(pv[0]), move_to_string(pv[1]));
+    if (Primary)
+        bestmove_to_ui(move_to_string(pv[0]), move_to_string(pv[1]));
 #endif
 
     if (UseLogFile)
@@ -808,8 +1243,12 @@ namespace {
             dbg_print_hit_rate(LogFile);
 
         LogFile << "\nNodes: " << TM.nodes_searched()
-                << "\nNodes/second: " << nps()
-                << "\nBest move: " << move_to_san(p, pv[0]);
+                << "\nNodes/second: " << nps();
+
+        if (TM.active_threads() > 1)
+            TM.print_thread_stats(LogFile);
+
+        LogFile << "\nBest move: " << move_to_san(p, pv[0]);
 
         StateInfo st;
         p.do_move(pv[0], st);
@@ -821,19 +1260,45 @@ namespace {
   }
 
 
-  // root_search() is the function which searches the root node. It is
-  // similar to search_pv except that it uses a different move ordering
-  // scheme, prints some information to the standard output and handles
-  // the fail low/high loops.
+  // helper_id_loop() is the iterative deepening loop of the helper threads in
+  // Lazy SMP mode. Each helper searches the root position on its own, with a
+  // full window and its own search stack, skipping some depths according to
+  // its thread id. Results are shared with the main thread only through the
+  // transposition table. The loop ends when the main thread sets AbortSearch.
 
-  Value root_search(Position& pos, SearchStack* ss, Move* pv, RootMoveList& rml, Value* alphaPtr, Value* betaPtr) {
+  void SearchContext::helper_id_loop(const Position& rootPos, int threadID) {
 
-    EvalInfo ei;
-    StateInfo st;
-    CheckInfo ci(pos);
-    int64_t nodes;
-    Move move;
-    Depth depth, ext, newDepth;
+    assert(threadID > TM.main_thread());
+
+    Position pos(rootPos, threadID);
+    SearchStack ss[PLY_MAX_PLUS_2];
+    int idx = (threadID - TM.main_thread() - 1) % LazySkipSize;
+
+    init_ss_array(ss, PLY_MAX_PLUS_2);
+
+    for (int d = 1; d < PLY_MAX - 1 && !AbortSearch; d++)
+    {
+        if (((d + LazySkipPhases[idx]) / LazySkipDepths[idx]) % 2)
+            continue;
+
+        search<PV>(pos, ss+1, -VALUE_INFINITE, VALUE_INFINITE, d * OnePly, 1);
+    }
+  }
+
+
+  // root_search() is the function which searches the root node. It is
+  // similar to search_pv except that it uses a different move ordering
+  // scheme, prints some information to the standard output and handles
+  // the fail low/high loops.
+
+  Value SearchContext::root_search(Position& pos, SearchStack* ss, Move* pv, RootMoveList& rml, Value* alphaPtr, Value* betaPtr) {
+
+    EvalInfo ei;
+    StateInfo st;
+    CheckInfo ci(pos);
+    int64_t nodes;
+    Move move;
+    Depth depth, ext, newDepth;
     Value value, alpha, beta;
     bool isCheck, moveIsCheck, captureOrPromotion, dangerous;
     int researchCountFH, researchCountFL;
@@ -858,6 +1323,12 @@ namespace {
     // Step 8. Null move search with verification search (omitted at root)
     // Step 9. Internal iterative deepening (omitted at root)
 
+    // Step extra. Parallel MultiPV
+    // The moves are shared among the threads, there are no aspiration windows
+    // nor fail low researches in MultiPV mode.
+    if (ParallelMultiPV && TM.active_threads() > 1)
+        return parallel_root_search(pos, ss, pv, rml);
+
     // Step extra. Fail low loop
     // We start with small aspiration window and in case of fail low, we research
     // with bigger window until we are not failing low anymore.
@@ -883,10 +1354,11 @@ namespace {
             move = ss->currentMove = rml.get_move(i);
 
             if (current_search_time() >= 1000) {
-                cout << "info currmove " << move
-                     << " currmovenumber " << i + 1 << endl;
+                Out << "info currmove " << move
+                    << " currmovenumber " << i + 1 << endl;
 #if defined(IPHONE_GLAURUNG)
-                currmove_to_ui(move_to_san(pos, move), i+1, rml.move_count());
+                if (Primary)
+                    currmove_to_ui(move_to_san(pos, move), i+1, rml.move_count());
 #endif
             }
 
@@ -1044,18 +1516,18 @@ namespace {
                     rml.sort_multipv(i);
                     for (int j = 0; j < Min(MultiPV, rml.move_count()); j++)
                     {
-                        cout << "info multipv " << j + 1
-                             << " score " << value_to_string(rml.get_move_score(j))
-                             << " depth " << (j <= i ? Iteration : Iteration - 1)
-                             << " time " << current_search_time()
-                             << " nodes " << TM.nodes_searched()
-                             << " nps " << nps()
-                             << " pv ";
+                        Out << "info multipv " << j + 1
+                            << " score " << value_to_string(rml.get_move_score(j))
+                            << " depth " << (j <= i ? Iteration : Iteration - 1)
+                            << " time " << current_search_time()
+                            << " nodes " << TM.nodes_searched()
+                            << " nps " << nps()
+                            << " pv ";
 
                         for (int k = 0; rml.get_move_pv(j, k) != MOVE_NONE && k < PLY_MAX; k++)
-                            cout << rml.get_move_pv(j, k) << " ";
+                            Out << rml.get_move_pv(j, k) << " ";
 
-                        cout << endl;
+                        Out << endl;
                     }
                     alpha = rml.get_move_score(Min(i, MultiPV - 1));
                 }
@@ -1086,16 +1558,258 @@ namespace {
   }
 
 
+  // parallel_root_search() is the root search in parallel MultiPV mode. All
+  // the active threads run multipv_worker() until every root move has been
+  // searched, then the moves are sorted and the PV of the best one is copied
+  // in pv[]. Like root_search() it returns the score of the last MultiPV line.
+
+  Value SearchContext::parallel_root_search(Position& pos, SearchStack* ss, Move* pv, RootMoveList& rml) {
+
+    assert(rml.move_count() <= 256);
+
+    rml.sort();
+
+    RootMoves = &rml;
+    RootDepth = (Iteration - 2) * OnePly + InitialDepth;
+    RootEval = ss->eval;
+    RootNextMove = 0;
+    memset(RootMoveDone, 0, sizeof(RootMoveDone));
+    FirstRootMove = true;
+    RootWorkers = TM.active_threads();
+
+    TM.start_helpers(&pos);
+    multipv_worker(pos, TM.main_thread());
+
+    // We are the main thread, so keep on polling while the helpers finish
+    // their last moves, and help them at their split points meanwhile. A
+    // helper waiting at its own split point is available too, so we cannot
+    // rely on helpers_finished() until all the root moves are done.
+    while (RootWorkers)
+    {
+        if (PollRequested)
+        {
+            PollRequested = false;
+            poll();
+        }
+        if (!TM.help_split_point(TM.main_thread()))
+#if !defined(_MSC_VER)
+            usleep(1000);
+#else
+            Sleep(1);
+#endif
+    }
+
+    while (!TM.helpers_finished()) {}
+
+    rml.sort();
+
+    if (rml.get_move_score(0) > -VALUE_INFINITE)
+    {
+        int i = 0;
+        for ( ; rml.get_move_pv(0, i) != MOVE_NONE && i < PLY_MAX; i++)
+            pv[i] = rml.get_move_pv(0, i);
+
+        pv[i] = MOVE_NONE;
+    }
+    return rml.get_move_score(Min(MultiPV, rml.move_count()) - 1);
+  }
+
+
+  // multipv_worker() picks the root moves not searched yet at the current
+  // iteration, one at a time, and searches them. The first MultiPV moves get
+  // a full window, the others are searched with the score of the MultiPV-th
+  // best move found so far as lower bound, like in root_search(). The bound
+  // can only raise meanwhile, so a move failing low is never one of the best
+  // lines. Idle threads can join the split points of the workers.
+
+  void SearchContext::multipv_worker(const Position& rootPos, int threadID) {
+
+    Position pos(rootPos, threadID);
+    SearchStack ss[PLY_MAX_PLUS_2];
+    Move pv[PLY_MAX_PLUS_2];
+    StateInfo st;
+    CheckInfo ci(pos);
+    Color us = pos.side_to_move();
+    Depth depth = RootDepth;
+    bool dangerous;
+
+    init_ss_array(ss, PLY_MAX_PLUS_2);
+    ss->eval = RootEval;
+
+    while (!AbortSearch)
+    {
+        lock_grab(&RootLock);
+
+        int i = RootNextMove++;
+        Value alpha = multipv_bound();
+
+        if (i < RootMoves->move_count() && current_search_time() >= 1000)
+            Out << "info currmove " << RootMoves->get_move(i)
+                << " currmovenumber " << i + 1 << endl;
+
+        lock_release(&RootLock);
+
+        if (i >= RootMoves->move_count())
+            break;
+
+        Move move = ss->currentMove = RootMoves->get_move(i);
+        bool moveIsCheck = pos.move_is_check(move);
+        bool captureOrPromotion = pos.move_is_capture_or_promotion(move);
+        Depth newDepth = depth + extension<PV>(pos, move, captureOrPromotion, moveIsCheck, false, false, &dangerous);
+        int64_t nodes = Threads[threadID].nodes;
+        int64_t our = Threads[threadID].betaCutOffs[us];
+        int64_t their = Threads[threadID].betaCutOffs[opposite_color(us)];
+        Value value;
+
+        pos.do_move(move, st, ci, moveIsCheck);
+
+        if (alpha == -VALUE_INFINITE)
+            value = -search<PV>(pos, ss+1, -VALUE_INFINITE, VALUE_INFINITE, newDepth, 1);
+        else
+        {
+            // Reduced and full depth searches with alpha as upper bound, as
+            // in root_search(). Here i >= MultiPV, as MultiPV moves are done.
+            bool doFullDepthSearch = true;
+
+            if (    depth >= 3 * OnePly
+                && !dangerous
+                && !captureOrPromotion
+                && !move_is_castle(move))
+            {
+                ss->reduction = reduction<PV>(depth, i - MultiPV + 2);
+                if (ss->reduction)
+                {
+                    value = -search<NonPV>(pos, ss+1, -(alpha+1), -alpha, newDepth-ss->reduction, 1);
+                    doFullDepthSearch = (value > alpha);
+                }
+
+                if (doFullDepthSearch && ss->reduction > 2 * OnePly)
+                {
+                    ss->reduction = OnePly;
+                    value = -search<NonPV>(pos, ss+1, -(alpha+1), -alpha, newDepth-ss->reduction, 1);
+                    doFullDepthSearch = (value > alpha);
+                }
+                ss->reduction = Depth(0);
+            }
+
+            if (doFullDepthSearch)
+            {
+                value = -search<NonPV>(pos, ss+1, -(alpha+1), -alpha, newDepth, 1);
+
+                if (value > alpha)
+                    value = -search<PV>(pos, ss+1, -VALUE_INFINITE, -alpha, newDepth, 1);
+            }
+        }
+
+        pos.undo_move(move);
+
+        // The score of an aborted search cannot be trusted, see root_search()
+        if (AbortSearch)
+            break;
+
+        assert(value > -VALUE_INFINITE && value < VALUE_INFINITE);
+
+        lock_grab(&RootLock);
+
+        RootMoves->set_beta_counters(i, Threads[threadID].betaCutOffs[us] - our,
+                                        Threads[threadID].betaCutOffs[opposite_color(us)] - their);
+        RootMoves->set_move_nodes(i, Threads[threadID].nodes - nodes);
+        RootMoveDone[i] = true;
+
+        if (i == 0)
+            FirstRootMove = false;
+
+        if (value > alpha)
+        {
+            RootMoves->set_move_score(i, value);
+            TT.extract_pv(pos, move, pv, PLY_MAX);
+            RootMoves->set_move_pv(i, pv);
+            print_multipv();
+        }
+        else
+            RootMoves->set_move_score(i, -VALUE_INFINITE);
+
+        lock_release(&RootLock);
+    }
+
+    lock_grab(&RootLock);
+    RootWorkers--;
+    lock_release(&RootLock);
+  }
+
+
+  // multipv_bound() returns the score of the MultiPV-th best move among the
+  // ones searched at the current iteration, or -VALUE_INFINITE if there are
+  // not enough of them yet. Called with RootLock held.
+
+  Value SearchContext::multipv_bound() const {
+
+    Value scores[256];
+    int n = 0;
+
+    for (int i = 0; i < RootMoves->move_count(); i++)
+        if (RootMoveDone[i])
+            scores[n++] = RootMoves->get_move_score(i);
+
+    if (n < MultiPV)
+        return -VALUE_INFINITE;
+
+    std::nth_element(scores, scores + MultiPV - 1, scores + n, std::greater<Value>());
+    return scores[MultiPV - 1];
+  }
+
+
+  // print_multipv() prints the MultiPV best lines, the moves not searched yet
+  // at the current iteration are listed with their score and depth of the
+  // previous one. Called with RootLock held.
+
+  void SearchContext::print_multipv() {
+
+    int idx[256];
+    int n = RootMoves->move_count();
+
+    for (int i = 0; i < n; i++)
+        idx[i] = i;
+
+    for (int j = 0; j < Min(MultiPV, n); j++)
+    {
+        // Select the best remaining move, on equal scores the first one
+        int best = j;
+        for (int i = j + 1; i < n; i++)
+            if (RootMoves->get_move_score(idx[i]) > RootMoves->get_move_score(idx[best]))
+                best = i;
+
+        int m = idx[best];
+        for (int i = best; i > j; i--)
+            idx[i] = idx[i - 1];
+        idx[j] = m;
+
+        Out << "info multipv " << j + 1
+            << " score " << value_to_string(RootMoves->get_move_score(m))
+            << " depth " << (RootMoveDone[m] ? Iteration : Iteration - 1)
+            << " time " << current_search_time()
+            << " nodes " << TM.nodes_searched()
+            << " nps " << nps()
+            << " pv ";
+
+        for (int k = 0; RootMoves->get_move_pv(m, k) != MOVE_NONE && k < PLY_MAX; k++)
+            Out << RootMoves->get_move_pv(m, k) << " ";
+
+        Out << endl;
+    }
+  }
+
+
   // search<>() is the main search function for both PV and non-PV nodes
 
   template <NodeType PvNode>
-  Value search(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply) {
+  Value SearchContext::search(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply) {
 
     assert(alpha >= -VALUE_INFINITE && alpha <= VALUE_INFINITE);
     assert(beta > alpha && beta <= VALUE_INFINITE);
     assert(PvNode || alpha == beta - 1);
     assert(ply > 0 && ply < PLY_MAX);
-    assert(pos.thread() >= 0 && pos.thread() < TM.active_threads());
+    assert(TM.thread_is_active(pos.thread()));
 
     if (Slowdown) slowdown(pos);
 
@@ -1103,6 +1817,7 @@ namespace {
     EvalInfo ei;
     StateInfo st;
     const TTEntry* tte;
+    TTEntry ttSnapshot;
     Key posKey;
     Move ttMove, move, excludedMove;
     Depth ext, newDepth;
@@ -1117,11 +1832,14 @@ namespace {
 
     // Step 1. Initialize node and poll. Polling can abort search
     TM.incrementNodeCounter(threadID);
+    SEARCH_STAT(threadID, nodesByDepth[Min(depth / OnePly, StatsDepths - 1)]);
+    SEARCH_STAT(threadID, nodesByPly[Min(ply, StatsPlies - 1)]);
     ss->init();
     (ss+2)->initKillers();
 
-    if (threadID == 0 && ++NodesSincePoll > NodesBetweenPolls)
+    if (threadID == TM.main_thread() && (PollRequested || ++NodesSincePoll > NodesBetweenPolls))
     {
+        PollRequested = false;
         NodesSincePoll = 0;
         poll();
     }
@@ -1146,8 +1864,9 @@ namespace {
     excludedMove = ss->excludedMove;
     posKey = excludedMove ? pos.get_exclusion_key() : pos.get_key();
 
-    tte = TT.retrieve(posKey);
+    tte = TT.retrieve(posKey, ttSnapshot, threadID);
     ttMove = (tte ? tte->move() : MOVE_NONE);
+    SEARCH_STAT(threadID, ttProbes);
 
     // At PV nodes, we don't use the TT for pruning, but only for move ordering.
     // This is to avoid problems in the following areas:
@@ -1160,12 +1879,16 @@ namespace {
     if (!PvNode && tte && ok_to_use_TT(tte, depth, beta, ply))
     {
         // Refresh tte entry to avoid aging
-        TT.store(posKey, tte->value(), tte->type(), tte->depth(), ttMove, tte->static_value(), tte->king_danger());
+        TT.store(posKey, tte->value(), tte->type(), tte->depth(), ttMove, tte->static_value(), tte->king_danger(), threadID);
+        SEARCH_STAT(threadID, ttCutoffs);
 
         ss->currentMove = ttMove; // Can be MOVE_NONE
         return value_from_tt(tte->value(), ply);
     }
 
+    if (tte)
+        TT.unusable_hit(threadID);
+
     // Step 5. Evaluate the position statically
     // At PV nodes we do this only to update gain statistics
     isCheck = pos.is_check();
@@ -1177,10 +1900,15 @@ namespace {
             ei.kingDanger[pos.side_to_move()] = tte->king_danger();
         }
         else
-            ss->eval = evaluate(pos, ei);
+            ss->eval = evaluate(pos, ei, alpha, beta);
 
         refinedValue = refine_eval(tte, ss->eval, ply); // Enhance accuracy with TT value if possible
-        update_gains(pos, (ss-1)->currentMove, (ss-1)->eval, ss->eval);
+
+        // A lazy evaluation is only a bound, see evaluate(), and must not
+        // feed the gains on either side of the move.
+        ss->lazyEval = ei.lazy;
+        if (!ss->lazyEval && !(ss-1)->lazyEval)
+            update_gains(pos, (ss-1)->currentMove, (ss-1)->eval, ss->eval);
     }
 
     // Step 6. Razoring (is omitted in PV nodes)
@@ -1194,15 +1922,19 @@ namespace {
         && !pos.has_pawn_on_7th(pos.side_to_move()))
     {
         // Pass ss->eval to qsearch() and avoid an evaluate call
-        if (!tte || tte->static_value() == VALUE_NONE)
-            TT.store(posKey, ss->eval, VALUE_TYPE_EXACT, Depth(-127*OnePly), MOVE_NONE, ss->eval, ei.kingDanger[pos.side_to_move()]);
+        if ((!tte || tte->static_value() == VALUE_NONE) && !ei.lazy)
+            TT.store(posKey, ss->eval, VALUE_TYPE_EXACT, Depth(-127*OnePly), MOVE_NONE, ss->eval, ei.kingDanger[pos.side_to_move()], threadID);
 
         Value rbeta = beta - razor_margin(depth);
         Value v = qsearch<NonPV>(pos, ss, rbeta-1, rbeta, Depth(0), ply);
+        SEARCH_STAT(threadID, razorTries);
         if (v < rbeta)
+        {
             // Logically we should return (v + razor_margin(depth)), but
             // surprisingly this did slightly weaker in tests.
+            SEARCH_STAT(threadID, razorCutoffs);
             return v;
+        }
     }
 
     // Step 7. Static null move pruning (is omitted in PV nodes)
@@ -1215,7 +1947,10 @@ namespace {
         && !isCheck
         && !value_is_mate(beta)
         &&  pos.non_pawn_material(pos.side_to_move()))
+    {
+        SEARCH_STAT(threadID, staticNullPrunes);
         return refinedValue - futility_margin(depth, 0);
+    }
 
     // Step 8. Null move search with verification search (is omitted in PV nodes)
     // When we jump directly to qsearch() we do a null move only if static value is
@@ -1230,6 +1965,7 @@ namespace {
         &&  pos.non_pawn_material(pos.side_to_move()))
     {
         ss->currentMove = MOVE_NULL;
+        SEARCH_STAT(threadID, nullTries);
 
         // Null move dynamic reduction based on depth
         int R = 3 + (depth >= 5 * OnePly ? depth / 8 : 0);
@@ -1248,6 +1984,8 @@ namespace {
 
         if (nullValue >= beta)
         {
+            SEARCH_STAT(threadID, nullCutoffs);
+
             // Do not return unproven mate scores
             if (nullValue >= value_mate_in(PLY_MAX))
                 nullValue = beta;
@@ -1294,7 +2032,7 @@ namespace {
         ss->skipNullMove = false;
 
         ttMove = ss->bestMove;
-        tte = TT.retrieve(posKey);
+        tte = TT.retrieve(posKey, ttSnapshot, threadID);
     }
 
     // Expensive mate threat detection (only for PV nodes)
@@ -1367,7 +2105,10 @@ namespace {
           if (   moveCount >= futility_move_count(depth)
               && !(ss->threatMove && connected_threat(pos, move, ss->threatMove))
               && bestValue > value_mated_in(PLY_MAX))
+          {
+              SEARCH_STAT(threadID, moveCountPrunes);
               continue;
+          }
 
           // Value based pruning
           // We illogically ignore reduction condition depth >= 3*OnePly for predicted depth,
@@ -1378,6 +2119,8 @@ namespace {
 
           if (futilityValueScaled < beta)
           {
+              SEARCH_STAT(threadID, futilityPrunes);
+
               if (futilityValueScaled > bestValue)
                   bestValue = futilityValueScaled;
               continue;
@@ -1412,6 +2155,8 @@ namespace {
                                      : - search<NonPV>(pos, ss+1, -(alpha+1), -alpha, d, ply+1);
 
                   doFullDepthSearch = (value > alpha);
+                  SEARCH_STAT(threadID, reductions);
+                  SEARCH_STAT_ADD(threadID, reSearches, doFullDepthSearch);
               }
 
               // The move failed high, but if reduction is very big we could
@@ -1438,8 +2183,11 @@ namespace {
               // Search only for possible new PV nodes, if instead value >= beta then
               // parent node fails low with value <= alpha and tries another move.
               if (PvNode && value > alpha && value < beta)
+              {
+                  SEARCH_STAT(threadID, pvReSearches);
                   value = newDepth < OnePly ? -qsearch<PV>(pos, ss+1, -beta, -alpha, Depth(0), ply+1)
                                             : - search<PV>(pos, ss+1, -beta, -alpha, newDepth, ply+1);
+              }
           }
       }
 
@@ -1471,6 +2219,7 @@ namespace {
           && TM.available_thread_exists(threadID)
           && !AbortSearch
           && !TM.thread_should_stop(threadID)
+          && !LazySMP
           && Iteration <= 99)
           TM.split<FakeSplit>(pos, ss, ply, &alpha, beta, &bestValue, depth,
                               mateThreat, &moveCount, &mp, PvNode);
@@ -1491,11 +2240,13 @@ namespace {
 
     ValueType f = (bestValue <= oldAlpha ? VALUE_TYPE_UPPER : bestValue >= beta ? VALUE_TYPE_LOWER : VALUE_TYPE_EXACT);
     move = (bestValue <= oldAlpha ? MOVE_NONE : ss->bestMove);
-    TT.store(posKey, value_to_tt(bestValue, ply), f, depth, move, ss->eval, ei.kingDanger[pos.side_to_move()]);
+    TT.store(posKey, value_to_tt(bestValue, ply), f, depth, move, ei.lazy ? VALUE_NONE : ss->eval, ei.kingDanger[pos.side_to_move()], threadID);
 
     // Update killers and history only for non capture moves that fails high
     if (bestValue >= beta)
     {
+        SEARCH_STAT(threadID, cutoffs);
+        SEARCH_STAT_ADD(threadID, firstMoveCutoffs, moveCount == 1);
         TM.incrementBetaCounter(pos.side_to_move(), depth, threadID);
         if (!pos.move_is_capture_or_promotion(move))
         {
@@ -1515,14 +2266,14 @@ namespace {
   // less than OnePly).
 
   template <NodeType PvNode>
-  Value qsearch(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply) {
+  Value SearchContext::qsearch(Position& pos, SearchStack* ss, Value alpha, Value beta, Depth depth, int ply) {
 
     assert(alpha >= -VALUE_INFINITE && alpha <= VALUE_INFINITE);
     assert(beta >= -VALUE_INFINITE && beta <= VALUE_INFINITE);
     assert(PvNode || alpha == beta - 1);
     assert(depth <= 0);
     assert(ply > 0 && ply < PLY_MAX);
-    assert(pos.thread() >= 0 && pos.thread() < TM.active_threads());
+    assert(TM.thread_is_active(pos.thread()));
 
     if (Slowdown) slowdown(pos);
 
@@ -1532,11 +2283,14 @@ namespace {
     Value bestValue, value, futilityValue, futilityBase;
     bool isCheck, deepChecks, enoughMaterial, moveIsCheck, evasionPrunable;
     const TTEntry* tte;
+    TTEntry ttSnapshot;
     Value oldAlpha = alpha;
 
     TM.incrementNodeCounter(pos.thread());
+    SEARCH_STAT(pos.thread(), qnodes);
     ss->bestMove = ss->currentMove = MOVE_NONE;
     ss->eval = VALUE_NONE;
+    ss->lazyEval = false;
 
     // Check for an instant draw or maximum ply reached
     if (pos.is_draw() || ply >= PLY_MAX - 1)
@@ -1544,7 +2298,7 @@ namespace {
 
     // Transposition table lookup. At PV nodes, we don't use the TT for
     // pruning, but only for move ordering.
-    tte = TT.retrieve(pos.get_key());
+    tte = TT.retrieve(pos.get_key(), ttSnapshot, pos.thread());
     ttMove = (tte ? tte->move() : MOVE_NONE);
 
     if (!PvNode && tte && ok_to_use_TT(tte, depth, beta, ply))
@@ -1553,6 +2307,9 @@ namespace {
         return value_from_tt(tte->value(), ply);
     }
 
+    if (tte)
+        TT.unusable_hit(pos.thread());
+
     isCheck = pos.is_check();
 
     // Evaluate the position statically
@@ -1569,16 +2326,18 @@ namespace {
             bestValue = tte->static_value();
         }
         else
-            bestValue = evaluate(pos, ei);
+            bestValue = evaluate(pos, ei, alpha, beta);
 
         ss->eval = bestValue;
-        update_gains(pos, (ss-1)->currentMove, (ss-1)->eval, ss->eval);
+        ss->lazyEval = ei.lazy;
+        if (!ss->lazyEval && !(ss-1)->lazyEval)
+            update_gains(pos, (ss-1)->currentMove, (ss-1)->eval, ss->eval);
 
         // Stand pat. Return immediately if static value is at least beta
         if (bestValue >= beta)
         {
             if (!tte)
-                TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, Depth(-127*OnePly), MOVE_NONE, ss->eval, ei.kingDanger[pos.side_to_move()]);
+                TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, Depth(-127*OnePly), MOVE_NONE, ei.lazy ? VALUE_NONE : ss->eval, ei.kingDanger[pos.side_to_move()], pos.thread());
 
             return bestValue;
         }
@@ -1675,7 +2434,7 @@ namespace {
     // Update transposition table
     Depth d = (depth == Depth(0) ? Depth(0) : Depth(-1));
     ValueType f = (bestValue <= oldAlpha ? VALUE_TYPE_UPPER : bestValue >= beta ? VALUE_TYPE_LOWER : VALUE_TYPE_EXACT);
-    TT.store(pos.get_key(), value_to_tt(bestValue, ply), f, d, ss->bestMove, ss->eval, ei.kingDanger[pos.side_to_move()]);
+    TT.store(pos.get_key(), value_to_tt(bestValue, ply), f, d, ss->bestMove, ei.lazy ? VALUE_NONE : ss->eval, ei.kingDanger[pos.side_to_move()], pos.thread());
 
     // Update killers only for checking moves that fails high
     if (    bestValue >= beta
@@ -1697,9 +2456,9 @@ namespace {
   // care of after we return from the split point.
 
   template <NodeType PvNode>
-  void sp_search(SplitPoint* sp, int threadID) {
+  void SearchContext::sp_search(SplitPoint* sp, int threadID) {
 
-    assert(threadID >= 0 && threadID < TM.active_threads());
+    assert(TM.thread_is_active(threadID));
     assert(TM.active_threads() > 1);
 
     StateInfo st;
@@ -1713,9 +2472,14 @@ namespace {
 
     Position pos(*sp->pos, threadID);
     CheckInfo ci(pos);
-    SearchStack* ss = sp->sstack[threadID] + 1;
+    SearchStack sstack[PLY_MAX_PLUS_2];
+    SearchStack* ss = sstack + 1;
     isCheck = pos.is_check();
 
+    // Copy the search stack tail of the master, (ss-1)...(ss+2), so that
+    // each thread can search the split point with its own search stack.
+    memcpy(sstack, sp->parentSstack - 1, 4 * sizeof(SearchStack));
+
     // Step 10. Loop through moves
     // Loop through all legal moves until no moves remain or a beta cutoff occurs
     lock_grab(&(sp->lock));
@@ -1751,6 +2515,7 @@ namespace {
               && !(ss->threatMove && connected_threat(pos, move, ss->threatMove))
               && sp->bestValue > value_mated_in(PLY_MAX))
           {
+              SEARCH_STAT(threadID, moveCountPrunes);
               lock_grab(&(sp->lock));
               continue;
           }
@@ -1762,6 +2527,7 @@ namespace {
 
           if (futilityValueScaled < sp->beta)
           {
+              SEARCH_STAT(threadID, futilityPrunes);
               lock_grab(&(sp->lock));
 
               if (futilityValueScaled > sp->bestValue)
@@ -1791,6 +2557,8 @@ namespace {
                                  : - search<NonPV>(pos, ss+1, -(localAlpha+1), -localAlpha, d, sp->ply+1);
 
               doFullDepthSearch = (value > localAlpha);
+              SEARCH_STAT(threadID, reductions);
+              SEARCH_STAT_ADD(threadID, reSearches, doFullDepthSearch);
           }
 
           // The move failed high, but if reduction is very big we could
@@ -1819,8 +2587,11 @@ namespace {
           // Search only for possible new PV nodes, if instead value >= beta then
           // parent node fails low with value <= alpha and tries another move.
           if (PvNode && value > localAlpha && value < sp->beta)
+          {
+              SEARCH_STAT(threadID, pvReSearches);
               value = newDepth < OnePly ? -qsearch<PV>(pos, ss+1, -sp->beta, -sp->alpha, Depth(0), sp->ply+1)
                                         : - search<PV>(pos, ss+1, -sp->beta, -sp->alpha, newDepth, sp->ply+1);
+          }
       }
 
       // Step 16. Undo move
@@ -1850,94 +2621,14 @@ namespace {
 
     /* Here we have the lock still grabbed */
 
+    // No more moves to search or a cutoff: nothing left for late joiners
+    sp->allSlavesSearching = false;
     sp->slaves[threadID] = 0;
 
     lock_release(&(sp->lock));
   }
 
 
-  // connected_moves() tests whether two moves are 'connected' in the sense
-  // that the first move somehow made the second move possible (for instance
-  // if the moving piece is the same in both moves). The first move is assumed
-  // to be the move that was made to reach the current position, while the
-  // second move is assumed to be a move from the current position.
-
-  bool connected_moves(const Position& pos, Move m1, Move m2) {
-
-    Square f1, t1, f2, t2;
-    Piece p;
-
-    assert(move_is_ok(m1));
-    assert(move_is_ok(m2));
-
-    if (m2 == MOVE_NONE)
-        return false;
-
-    // Case 1: The moving piece is the same in both moves
-    f2 = move_from(m2);
-    t1 = move_to(m1);
-    if (f2 == t1)
-        return true;
-
-    // Case 2: The destination square for m2 was vacated by m1
-    t2 = move_to(m2);
-    f1 = move_from(m1);
-    if (t2 == f1)
-        return true;
-
-    // Case 3: Moving through the vacated square
-    if (   piece_is_slider(pos.piece_on(f2))
-        && bit_is_set(squares_between(f2, t2), f1))
-      return true;
-
-    // Case 4: The destination square for m2 is defended by the moving piece in m1
-    p = pos.piece_on(t1);
-    if (bit_is_set(pos.attacks_from(p, t1), t2))
-        return true;
-
-    // Case 5: Discovered check, checking piece is the piece moved in m1
-    if (    piece_is_slider(p)
-        &&  bit_is_set(squares_between(t1, pos.king_square(pos.side_to_move())), f2)
-        && !bit_is_set(squares_between(t1, pos.king_square(pos.side_to_move())), t2))
-    {
-        // discovered_check_candidates() works also if the Position's side to
-        // move is the opposite of the checking piece.
-        Color them = opposite_color(pos.side_to_move());
-        Bitboard dcCandidates = pos.discovered_check_candidates(them);
-
-        if (bit_is_set(dcCandidates, f2))
-            return true;
-    }
-    return false;
-  }
-
-
-  // value_is_mate() checks if the given value is a mate one
-  // eventually compensated for the ply.
-
-  bool value_is_mate(Value value) {
-
-    assert(abs(value) <= VALUE_INFINITE);
-
-    return   value <= value_mated_in(PLY_MAX)
-          || value >= value_mate_in(PLY_MAX);
-  }
-
-
-  // move_is_killer() checks if the given move is among the
-  // killer moves of that ply.
-
-  bool move_is_killer(Move m, SearchStack* ss) {
-
-      const Move* k = ss->killers;
-      for (int i = 0; i < KILLER_MAX; i++, k++)
-          if (*k == m)
-              return true;
-
-      return false;
-  }
-
-
   // extension() decides whether a move should be searched with normal depth,
   // or with extended depth. Certain classes of moves (checking moves, in
   // particular) are searched with bigger depth than ordinary moves and in
@@ -1945,8 +2636,8 @@ namespace {
   // extended, as example because the corresponding UCI option is set to zero,
   // the move is marked as 'dangerous' so, at least, we avoid to prune it.
   template <NodeType PvNode>
-  Depth extension(const Position& pos, Move m, bool captureOrPromotion, bool moveIsCheck,
-                  bool singleEvasion, bool mateThreat, bool* dangerous) {
+  Depth SearchContext::extension(const Position& pos, Move m, bool captureOrPromotion, bool moveIsCheck,
+                                 bool singleEvasion, bool mateThreat, bool* dangerous) {
 
     assert(m != MOVE_NONE);
 
@@ -2004,183 +2695,122 @@ namespace {
   }
 
 
-  // connected_threat() tests whether it is safe to forward prune a move or if
-  // is somehow coonected to the threat move returned by null search.
+  // update_history() registers a good move that produced a beta-cutoff
+  // in history and marks as failures all the other moves of that ply.
 
-  bool connected_threat(const Position& pos, Move m, Move threat) {
+  void SearchContext::update_history(const Position& pos, Move move, Depth depth,
+                                     Move movesSearched[], int moveCount) {
 
-    assert(move_is_ok(m));
-    assert(threat && move_is_ok(threat));
-    assert(!pos.move_is_check(m));
-    assert(!pos.move_is_capture_or_promotion(m));
-    assert(!pos.move_is_passed_pawn_push(m));
+    Move m;
 
-    Square mfrom, mto, tfrom, tto;
+    H.success(pos.piece_on(move_from(move)), move_to(move), depth);
 
-    mfrom = move_from(m);
-    mto = move_to(m);
-    tfrom = move_from(threat);
-    tto = move_to(threat);
+    for (int i = 0; i < moveCount - 1; i++)
+    {
+        m = movesSearched[i];
 
-    // Case 1: Don't prune moves which move the threatened piece
-    if (mfrom == tto)
-        return true;
+        assert(m != move);
 
-    // Case 2: If the threatened piece has value less than or equal to the
-    // value of the threatening piece, don't prune move which defend it.
-    if (   pos.move_is_capture(threat)
-        && (   pos.midgame_value_of_piece_on(tfrom) >= pos.midgame_value_of_piece_on(tto)
-            || pos.type_of_piece_on(tfrom) == KING)
-        && pos.move_attacks_square(m, tto))
-        return true;
+        if (!pos.move_is_capture_or_promotion(m))
+            H.failure(pos.piece_on(move_from(m)), move_to(m), depth);
+    }
+  }
 
-    // Case 3: If the moving piece in the threatened move is a slider, don't
-    // prune safe moves which block its ray.
-    if (   piece_is_slider(pos.piece_on(tfrom))
-        && bit_is_set(squares_between(tfrom, tto), mto)
-        && pos.see_sign(m) >= 0)
-        return true;
 
-    return false;
-  }
-
-
-  // ok_to_use_TT() returns true if a transposition table score
-  // can be used at a given point in search.
-
-  bool ok_to_use_TT(const TTEntry* tte, Depth depth, Value beta, int ply) {
-
-    Value v = value_from_tt(tte->value(), ply);
+  // update_gains() updates the gains table of a non-capture move given
+  // the static position evaluation before and after the move.
 
-    return   (   tte->depth() >= depth
-              || v >= Max(value_mate_in(PLY_MAX), beta)
-              || v < Min(value_mated_in(PLY_MAX), beta))
+  void SearchContext::update_gains(const Position& pos, Move m, Value before, Value after) {
 
-          && (   (is_lower_bound(tte->type()) && v >= beta)
-              || (is_upper_bound(tte->type()) && v < beta));
+    if (   m != MOVE_NULL
+        && before != VALUE_NONE
+        && after != VALUE_NONE
+        && pos.captured_piece() == NO_PIECE_TYPE
+        && !move_is_castle(m)
+        && !move_is_promotion(m))
+        H.set_gain(pos.piece_on(move_to(m)), move_to(m), -(before + after));
   }
 
 
-  // refine_eval() returns the transposition table score if
-  // possible otherwise falls back on static position evaluation.
+  // slowdown() is used in strength handicap mode. The thread searches at
+  // full speed for a batch of nodes and then sleeps, so that it is busy for
+  // Slowdown per mille of the time. This gives the node rate of the old loop
+  // wasting CPU at each node, but yields the CPU instead of burning it. Time
+  // spent idle at split points does not count as busy. The thread sleeps in
+  // short steps, so that a stopped search is not kept waiting.
 
-  Value refine_eval(const TTEntry* tte, Value defaultEval, int ply) {
+  void SearchContext::slowdown(const Position& pos) {
 
-      if (!tte)
-          return defaultEval;
-
-      Value v = value_from_tt(tte->value(), ply);
-
-      if (   (is_lower_bound(tte->type()) && v >= defaultEval)
-          || (is_upper_bound(tte->type()) && v < defaultEval))
-          return v;
-
-      return defaultEval;
-  }
-
-
-  // update_history() registers a good move that produced a beta-cutoff
-  // in history and marks as failures all the other moves of that ply.
+    if (Iteration < 3)
+        return;
 
-  void update_history(const Position& pos, Move move, Depth depth,
-                      Move movesSearched[], int moveCount) {
+    Thread& t = Threads[pos.thread()];
 
-    Move m;
+    if (++t.throttleNodes < SlowdownBatch)
+        return;
 
-    H.success(pos.piece_on(move_from(move)), move_to(move), depth);
+    t.throttleNodes = 0;
+    int64_t now = get_monotonic_time_us();
 
-    for (int i = 0; i < moveCount - 1; i++)
+    if (!t.throttleStart)
     {
-        m = movesSearched[i];
-
-        assert(m != move);
-
-        if (!pos.move_is_capture_or_promotion(m))
-            H.failure(pos.piece_on(move_from(m)), move_to(m), depth);
+        t.throttleStart = now;
+        t.throttleIdle = t.idleTime;
+        return;
     }
-  }
 
+    int64_t elapsed = now - t.throttleStart;
+    int64_t busy = elapsed - t.throttleSleep - int64_t(t.idleTime - t.throttleIdle);
+    int64_t wait = busy * 1000 / Slowdown - elapsed;
 
-  // update_killers() add a good move that produced a beta-cutoff
-  // among the killer moves of that ply.
-
-  void update_killers(Move m, SearchStack* ss) {
-
-    if (m == ss->killers[0])
+    // Do not bother sleeping for less than a millisecond
+    if (wait < 1000)
         return;
 
-    for (int i = KILLER_MAX - 1; i > 0; i--)
-        ss->killers[i] = ss->killers[i - 1];
-
-    ss->killers[0] = m;
-  }
-
-
-  // update_gains() updates the gains table of a non-capture move given
-  // the static position evaluation before and after the move.
-
-  void update_gains(const Position& pos, Move m, Value before, Value after) {
-
-    if (   m != MOVE_NULL
-        && before != VALUE_NONE
-        && after != VALUE_NONE
-        && pos.captured_piece() == NO_PIECE_TYPE
-        && !move_is_castle(m)
-        && !move_is_promotion(m))
-        H.set_gain(pos.piece_on(move_to(m)), move_to(m), -(before + after));
-  }
-
-
-  // slowdown() simply wastes CPU cycles doing nothing useful. It's used
-  // in strength handicap mode.
-
-  void slowdown(const Position &pos) {
-     if (Iteration < 3)
-        return;
-     for (int i = 0; i < Slowdown; i++)  {
-        Square s = Square(i&63);
-        if (count_1s<false>(pos.attackers_to(s)) > 63)
-           std::cout << "This can't happen, but I put this string here anyway, in order to prevent the compiler from optimizing away the useless computation." << std::endl;
-     }
+    for (int64_t slept = 0; slept < wait && !AbortSearch; slept = get_monotonic_time_us() - now)
+    {
+#if !defined(_MSC_VER)
+        usleep(useconds_t(Min(wait - slept, int64_t(SlowdownMaxSleep))));
+#else
+        Sleep(DWORD(Min(wait - slept, int64_t(SlowdownMaxSleep)) / 1000));
+#endif
+    }
+    t.throttleSleep += get_monotonic_time_us() - now;
   }
 
 
   // current_search_time() returns the number of milliseconds which have passed
   // since the beginning of the current search.
 
-  int current_search_time() {
+  int SearchContext::current_search_time() {
 
-    return get_system_time() - SearchStartTime;
+    return get_monotonic_time() - SearchStartTime;
   }
 
 
   // nps() computes the current nodes/second count.
 
-  int nps() {
+  int SearchContext::nps() {
 
     int t = current_search_time();
     return (t > 0 ? int((TM.nodes_searched() * 1000) / t) : 0);
   }
 
 
-  // poll() performs two different functions: It polls for user input, and it
-  // looks at the time consumed so far and decides if it's time to abort the
-  // search.
+  // poll() is called by the main thread of the search when the timer thread
+  // asks for it, or after NodesBetweenPolls nodes in node limited searches.
+  // It reads the input, only in the primary context, prints information
+  // every second, and checks the search limits.
 
-  void poll() {
+  void SearchContext::poll() {
 
-    static int lastInfoTime;
     int t = current_search_time();
 
     //  Poll for input
 #if !defined(IPHONE_GLAURUNG)
-    if (Bioskey())
+    if (Primary && input_available())
     {
-        // We are line oriented, don't read single chars
-        std::string command;
-
-        if (!std::getline(std::cin, command))
-            command = "quit";
+        std::string command = read_input();
 
         if (command == "quit")
         {
@@ -2198,7 +2828,7 @@ namespace {
             ponderhit();
     }
 #else
-    if (command_is_waiting())
+    if (Primary && command_is_waiting())
     {
         std::string command = get_command();
         if (command == "quit")
@@ -2220,16 +2850,16 @@ namespace {
 
     // Print search information
     if (t < 1000)
-        lastInfoTime = 0;
+        LastInfoTime = 0;
 
-    else if (lastInfoTime > t)
+    else if (LastInfoTime > t)
         // HACK: Must be a new search where we searched less than
         // NodesBetweenPolls nodes during the first second of search.
-        lastInfoTime = 0;
+        LastInfoTime = 0;
 
-    else if (t - lastInfoTime >= 1000)
+    else if (t - LastInfoTime >= 1000)
     {
-        lastInfoTime = t;
+        LastInfoTime = t;
 
         if (dbg_show_mean)
             dbg_print_mean();
@@ -2237,18 +2867,30 @@ namespace {
         if (dbg_show_hit_rate)
             dbg_print_hit_rate();
 
-        cout << "info nodes " << TM.nodes_searched() << " nps " << nps()
-             << " time " << t << " hashfull " << TT.full() << endl;
+        Out << "info nodes " << TM.nodes_searched() << " nps " << nps()
+            << " time " << t << " hashfull " << TT.full() << endl;
 
 #if defined(IPHONE_GLAURUNG)
-        searchstats_to_ui(Iteration, nodes_searched(), t);
+        if (Primary)
+            searchstats_to_ui(Iteration, TM.nodes_searched(), t);
 #endif
     }
 
-    // Should we stop the search?
+    check_limits();
+  }
+
+
+  // check_limits() looks at the time consumed so far and at the nodes searched
+  // and decides if it's time to abort the search. It is called by the timer
+  // thread too, so it only sets AbortSearch.
+
+  void SearchContext::check_limits() {
+
     if (PonderSearch)
         return;
 
+    int t = current_search_time();
+
     bool stillAtFirstMove =    FirstRootMove
                            && !AspirationFailLow
                            &&  t > MaxSearchTime + ExtraSearchTime;
@@ -2263,11 +2905,139 @@ namespace {
   }
 
 
+  // start_timer() launches the timer thread of the search, stop_timer() stops
+  // it. If the thread cannot be launched the search polls every 30000 nodes.
+
+  void SearchContext::start_timer() {
+
+    TimerStop = false;
+    lock_init(&TimerLock, NULL);
+
+#if !defined(_MSC_VER)
+    // Wait on the monotonic clock, see timer_loop()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#  if !defined(__APPLE__)
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#  endif
+    pthread_cond_init(&TimerCond, &attr);
+    pthread_condattr_destroy(&attr);
+    TimerStarted = (pthread_create(&TimerThread, NULL, timer_thread, this) == 0);
+#else
+    TimerEvent = CreateEvent(0, FALSE, FALSE, 0);
+    TimerStarted = ((TimerThread = CreateThread(NULL, 0, timer_thread, this, 0, NULL)) != NULL);
+#endif
+
+    if (!TimerStarted)
+        NodesBetweenPolls = Min(NodesBetweenPolls, 30000);
+  }
+
+  void SearchContext::stop_timer() {
+
+    if (TimerStarted)
+    {
+        lock_grab(&TimerLock);
+        TimerStop = true;
+#if !defined(_MSC_VER)
+        pthread_cond_signal(&TimerCond);
+#else
+        SetEvent(TimerEvent);
+#endif
+        lock_release(&TimerLock);
+
+#if !defined(_MSC_VER)
+        pthread_join(TimerThread, NULL);
+#else
+        WaitForSingleObject(TimerThread, INFINITE);
+        CloseHandle(TimerThread);
+#endif
+        TimerStarted = false;
+    }
+
+#if !defined(_MSC_VER)
+    pthread_cond_destroy(&TimerCond);
+#else
+    CloseHandle(TimerEvent);
+#endif
+    lock_destroy(&TimerLock);
+  }
+
+
+  // timer_loop() is run by the timer thread of a search. Every PollPeriod
+  // milliseconds it checks the search limits, stopping the search as soon
+  // as one is reached, and asks the main thread to poll. The waits are
+  // measured on the monotonic clock, so that setting back the wall clock
+  // cannot stall the timer, that is the only one stopping the search and
+  // reading the input. OS X has no monotonic condition variables, but a
+  // relative wait.
+
+  void SearchContext::timer_loop() {
+
+    lock_grab(&TimerLock);
+
+    while (!TimerStop)
+    {
+        int wait = timer_wait();
+
+#if defined(__APPLE__)
+        struct timespec period;
+        period.tv_sec = 0;
+        period.tv_nsec = wait * 1000000;
+        pthread_cond_timedwait_relative_np(&TimerCond, &TimerLock, &period);
+#elif !defined(_MSC_VER)
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += wait * 1000000;
+        if (until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&TimerCond, &TimerLock, &until);
+#else
+        lock_release(&TimerLock);
+        WaitForSingleObject(TimerEvent, wait);
+        lock_grab(&TimerLock);
+#endif
+        if (TimerStop)
+            break;
+
+        check_limits();
+        PollRequested = true;
+    }
+
+    lock_release(&TimerLock);
+  }
+
+
+  // timer_wait() returns how many milliseconds the timer thread waits before
+  // its next check: PollPeriod, or less if a hard time limit expires sooner.
+  // Waking up just at the limit, instead of at the next multiple of the
+  // period, saves up to PollPeriod milliseconds of overshoot.
+
+  int SearchContext::timer_wait() {
+
+    int wait = PollPeriod;
+
+    if (!PonderSearch)
+    {
+        int t = current_search_time();
+
+        if (ExactMaxTime)
+            wait = Min(wait, ExactMaxTime - t);
+
+        if (UseTimeManagement)
+            wait = Min(wait, AbsoluteMaxSearchTime + 1 - t);
+    }
+    return Max(wait, 1);
+  }
+
+
   // ponderhit() is called when the program is pondering (i.e. thinking while
   // it's the opponent's turn to move) in order to let the engine know that
   // it correctly predicted the opponent's move.
 
-  void ponderhit() {
+  void SearchContext::ponderhit() {
 
     int t = current_search_time();
     PonderSearch = false;
@@ -2284,41 +3054,41 @@ namespace {
   }
 
 
-  // init_ss_array() does a fast reset of the first entries of a SearchStack
-  // array and of all the excludedMove and skipNullMove entries.
-
-  void init_ss_array(SearchStack* ss, int size) {
-
-    for (int i = 0; i < size; i++, ss++)
-    {
-        ss->excludedMove = MOVE_NONE;
-        ss->skipNullMove = false;
-
-        if (i < 3)
-        {
-            ss->init();
-            ss->initKillers();
-        }
-    }
-  }
-
-
   // wait_for_stop_or_ponderhit() is called when the maximum depth is reached
   // while the program is pondering. The point is to work around a wrinkle in
   // the UCI protocol: When pondering, the engine is not allowed to give a
   // "bestmove" before the GUI sends it a "stop" or "ponderhit" command.
   // We simply wait here until one of these commands is sent, and return,
   // after which the bestmove and pondermove will be printed (in id_loop()).
+  // The other contexts sleep until stop_search() is called instead.
 
-  void wait_for_stop_or_ponderhit() {
+  void SearchContext::wait_for_stop_or_ponderhit() {
 
     std::string command;
 
+    if (!Primary)
+    {
+        lock_grab(&StopLock);
+
+        while (!AbortSearch)
+        {
+#if !defined(_MSC_VER)
+            pthread_cond_wait(&StopCond, &StopLock);
+#else
+            lock_release(&StopLock);
+            WaitForSingleObject(StopEvent, INFINITE);
+            lock_grab(&StopLock);
+#endif
+        }
+
+        lock_release(&StopLock);
+        return;
+    }
+
     while (true)
     {
 #if !defined(IPHONE_GLAURUNG)
-        if (!std::getline(std::cin, command))
-            command = "quit";
+        command = read_input();
 #else
         if (command_is_waiting())
            command = get_command();
@@ -2337,59 +3107,443 @@ namespace {
   }
 
 
-  // print_pv_info() prints to standard output and eventually to log file information on
-  // the current PV line. It is called at each iteration or after a new pv is found.
+  // print_pv_info() prints to standard output and eventually to log file information on
+  // the current PV line. It is called at each iteration or after a new pv is found.
+
+  void SearchContext::print_pv_info(const Position& pos, Move pv[], Value alpha, Value beta, Value value) {
+
+    Out << "info depth " << Iteration
+        << " score "     << value_to_string(value)
+        << (value >= beta ? " lowerbound" : value <= alpha ? " upperbound" : "")
+        << " time "  << current_search_time()
+        << " nodes " << TM.nodes_searched()
+        << " nps "   << nps()
+        << " pv ";
+
+    for (Move* m = pv; *m != MOVE_NONE; m++)
+        Out << *m << " ";
+
+    Out << endl;
+
+#if !defined(IPHONE_GLAURUNG)
+    if (UseLogFile)
+    {
+        ValueType t = value >= beta  ? VALUE_TYPE_LOWER :
+                      value <= alpha ? VALUE_TYPE_UPPER : VALUE_TYPE_EXACT;
+
+        LogFile << pretty_pv(pos, current_search_time(), Iteration,
+                             TM.nodes_searched(), value, t, pv) << endl;
+    }
+#else
+    if (!Primary)
+        return;
+
+    std::stringstream str;
+    bool iAmWhite = (pos.side_to_move() == WHITE);
+    str << Iteration << " ";
+    if ((value >= beta && iAmWhite) || (value <= alpha && !iAmWhite))
+      str << ">";
+    else if ((value >= beta && !iAmWhite) || (value <= alpha && iAmWhite))
+      str << "<";
+    if (abs(value) >= VALUE_MATE - 200) {
+      if (value < 0)
+        str << (iAmWhite? '-' : '+') << '#'
+            << (VALUE_MATE + value) / 2;
+      else
+        str << (iAmWhite? '+' : '-') << '#'
+            << (VALUE_MATE - value + 1) / 2;
+    }
+    else
+      str << (((iAmWhite && value > 0) || (!iAmWhite && value < 0))? "+" : "")
+          << std::setiosflags(std::ios::fixed) << std::setprecision(1)
+          << value_to_centipawns(iAmWhite? value : -value) / 100.0;
+    str << " " << line_to_san(pos, pv, 0, false, 0);
+    pv_to_ui(str.str());
+#endif
+
+  }
+
+#if defined(SEARCH_STATS)
+
+namespace {
+
+  // stats_array() and stats_rate() format the search statistics as JSON.
+  // Arrays are printed up to their last non zero element.
+
+  std::string stats_array(const uint64_t a[], int size) {
+
+    std::ostringstream s;
+
+    while (size > 1 && !a[size - 1])
+        size--;
+
+    s << '[';
+    for (int i = 0; i < size; i++)
+        s << (i ? "," : "") << a[i];
+    s << ']';
+    return s.str();
+  }
+
+  double stats_rate(uint64_t n, uint64_t total) { return total ? double(n) / total : 0.0; }
+}
+
+
+  // print_search_stats() prints the search tree statistics of the threads
+  // of the context for the last iteration as a JSON object, on one line
+  // after "info string stats", and to the log file.
+
+  void SearchContext::print_search_stats() {
+
+    SearchStats st;
+    uint64_t nodes = 0;
+
+    // All the counters are uint64_t, so that they can be summed as an array
+    const int counters = int(offsetof(SearchStats, pad) / sizeof(uint64_t));
+    memset(&st, 0, sizeof(SearchStats));
+
+    for (int i = TM.main_thread(); i < TM.main_thread() + TM.threads_count(); i++)
+        for (int j = 0; j < counters; j++)
+            ((uint64_t*)&st)[j] += ((const uint64_t*)&Stats[i])[j];
+
+    for (int i = 0; i < StatsDepths; i++)
+        nodes += st.nodesByDepth[i];
+
+    std::ostringstream s;
+    s << std::setprecision(4)
+      << "{\"iteration\":" << Iteration
+      << ",\"search_nodes\":" << nodes
+      << ",\"qnodes\":" << st.qnodes
+      << ",\"qsearch_share\":" << stats_rate(st.qnodes, nodes + st.qnodes)
+      << ",\"nodes_by_depth\":" << stats_array(st.nodesByDepth, StatsDepths)
+      << ",\"nodes_by_ply\":" << stats_array(st.nodesByPly, StatsPlies)
+      << ",\"tt_probes\":" << st.ttProbes
+      << ",\"tt_cutoffs\":" << st.ttCutoffs
+      << ",\"tt_cutoff_rate\":" << stats_rate(st.ttCutoffs, st.ttProbes)
+      << ",\"beta_cutoffs\":" << st.cutoffs
+      << ",\"first_move_cutoff_rate\":" << stats_rate(st.firstMoveCutoffs, st.cutoffs)
+      << ",\"null_move_tries\":" << st.nullTries
+      << ",\"null_move_success_rate\":" << stats_rate(st.nullCutoffs, st.nullTries)
+      << ",\"razoring_tries\":" << st.razorTries
+      << ",\"razoring_prunes\":" << st.razorCutoffs
+      << ",\"static_null_prunes\":" << st.staticNullPrunes
+      << ",\"move_count_prunes\":" << st.moveCountPrunes
+      << ",\"futility_prunes\":" << st.futilityPrunes
+      << ",\"lmr_reductions\":" << st.reductions
+      << ",\"lmr_research_rate\":" << stats_rate(st.reSearches, st.reductions)
+      << ",\"pv_researches\":" << st.pvReSearches
+      << '}';
+
+    Out << "info string stats " << s.str() << endl;
+
+    if (UseLogFile)
+        LogFile << s.str() << endl;
+  }
+
+#endif
+
+
+namespace {
+
+  // connected_moves() tests whether two moves are 'connected' in the sense
+  // that the first move somehow made the second move possible (for instance
+  // if the moving piece is the same in both moves). The first move is assumed
+  // to be the move that was made to reach the current position, while the
+  // second move is assumed to be a move from the current position.
+
+  bool connected_moves(const Position& pos, Move m1, Move m2) {
+
+    Square f1, t1, f2, t2;
+    Piece p;
+
+    assert(move_is_ok(m1));
+    assert(move_is_ok(m2));
+
+    if (m2 == MOVE_NONE)
+        return false;
+
+    // Case 1: The moving piece is the same in both moves
+    f2 = move_from(m2);
+    t1 = move_to(m1);
+    if (f2 == t1)
+        return true;
+
+    // Case 2: The destination square for m2 was vacated by m1
+    t2 = move_to(m2);
+    f1 = move_from(m1);
+    if (t2 == f1)
+        return true;
+
+    // Case 3: Moving through the vacated square
+    if (   piece_is_slider(pos.piece_on(f2))
+        && bit_is_set(squares_between(f2, t2), f1))
+      return true;
+
+    // Case 4: The destination square for m2 is defended by the moving piece in m1
+    p = pos.piece_on(t1);
+    if (bit_is_set(pos.attacks_from(p, t1), t2))
+        return true;
+
+    // Case 5: Discovered check, checking piece is the piece moved in m1
+    if (    piece_is_slider(p)
+        &&  bit_is_set(squares_between(t1, pos.king_square(pos.side_to_move())), f2)
+        && !bit_is_set(squares_between(t1, pos.king_square(pos.side_to_move())), t2))
+    {
+        // discovered_check_candidates() works also if the Position's side to
+        // move is the opposite of the checking piece.
+        Color them = opposite_color(pos.side_to_move());
+        Bitboard dcCandidates = pos.discovered_check_candidates(them);
+
+        if (bit_is_set(dcCandidates, f2))
+            return true;
+    }
+    return false;
+  }
+
+
+  // value_is_mate() checks if the given value is a mate one
+  // eventually compensated for the ply.
+
+  bool value_is_mate(Value value) {
+
+    assert(abs(value) <= VALUE_INFINITE);
+
+    return   value <= value_mated_in(PLY_MAX)
+          || value >= value_mate_in(PLY_MAX);
+  }
+
+
+  // move_is_killer() checks if the given move is among the
+  // killer moves of that ply.
+
+  bool move_is_killer(Move m, SearchStack* ss) {
+
+      const Move* k = ss->killers;
+      for (int i = 0; i < KILLER_MAX; i++, k++)
+          if (*k == m)
+              return true;
+
+      return false;
+  }
+
+
+  // connected_threat() tests whether it is safe to forward prune a move or if
+  // is somehow coonected to the threat move returned by null search.
+
+  bool connected_threat(const Position& pos, Move m, Move threat) {
+
+    assert(move_is_ok(m));
+    assert(threat && move_is_ok(threat));
+    assert(!pos.move_is_check(m));
+    assert(!pos.move_is_capture_or_promotion(m));
+    assert(!pos.move_is_passed_pawn_push(m));
+
+    Square mfrom, mto, tfrom, tto;
+
+    mfrom = move_from(m);
+    mto = move_to(m);
+    tfrom = move_from(threat);
+    tto = move_to(threat);
+
+    // Case 1: Don't prune moves which move the threatened piece
+    if (mfrom == tto)
+        return true;
+
+    // Case 2: If the threatened piece has value less than or equal to the
+    // value of the threatening piece, don't prune move which defend it.
+    if (   pos.move_is_capture(threat)
+        && (   pos.midgame_value_of_piece_on(tfrom) >= pos.midgame_value_of_piece_on(tto)
+            || pos.type_of_piece_on(tfrom) == KING)
+        && pos.move_attacks_square(m, tto))
+        return true;
+
+    // Case 3: If the moving piece in the threatened move is a slider, don't
+    // prune safe moves which block its ray.
+    if (   piece_is_slider(pos.piece_on(tfrom))
+        && bit_is_set(squares_between(tfrom, tto), mto)
+        && pos.see_sign(m) >= 0)
+        return true;
+
+    return false;
+  }
+
+
+  // ok_to_use_TT() returns true if a transposition table score
+  // can be used at a given point in search.
+
+  bool ok_to_use_TT(const TTEntry* tte, Depth depth, Value beta, int ply) {
+
+    Value v = value_from_tt(tte->value(), ply);
+
+    return   (   tte->depth() >= depth
+              || v >= Max(value_mate_in(PLY_MAX), beta)
+              || v < Min(value_mated_in(PLY_MAX), beta))
+
+          && (   (is_lower_bound(tte->type()) && v >= beta)
+              || (is_upper_bound(tte->type()) && v < beta));
+  }
+
+
+  // refine_eval() returns the transposition table score if
+  // possible otherwise falls back on static position evaluation.
+
+  Value refine_eval(const TTEntry* tte, Value defaultEval, int ply) {
+
+      if (!tte)
+          return defaultEval;
+
+      Value v = value_from_tt(tte->value(), ply);
+
+      if (   (is_lower_bound(tte->type()) && v >= defaultEval)
+          || (is_upper_bound(tte->type()) && v < defaultEval))
+          return v;
+
+      return defaultEval;
+  }
+
+
+  // update_killers() add a good move that produced a beta-cutoff
+  // among the killer moves of that ply.
+
+  void update_killers(Move m, SearchStack* ss) {
+
+    if (m == ss->killers[0])
+        return;
+
+    for (int i = KILLER_MAX - 1; i > 0; i--)
+        ss->killers[i] = ss->killers[i - 1];
+
+    ss->killers[0] = m;
+  }
+
+
+  // init_ss_array() does a fast reset of the first entries of a SearchStack
+  // array and of all the excludedMove and skipNullMove entries.
+
+  void init_ss_array(SearchStack* ss, int size) {
+
+    for (int i = 0; i < size; i++, ss++)
+    {
+        ss->excludedMove = MOVE_NONE;
+        ss->skipNullMove = false;
+
+        if (i < 3)
+        {
+            ss->init();
+            ss->initKillers();
+        }
+    }
+  }
+
+
+  // perft_count() returns the number of leaf nodes of the tree of the given
+  // depth, in plies, rooted at pos. At the last ply the legal moves are only
+  // generated and counted, above it the counts are looked up in and stored
+  // to the perft hash table, when there is one.
+
+  int64_t perft_count(Position& pos, int depth) {
+
+    MoveStack mlist[256];
+    StateInfo st;
+    MoveStack* last = generate_moves(pos, mlist);
+
+    if (depth <= 1)
+        return last - mlist;
+
+    Key key = pos.get_key();
+    PerftEntry* e = PerftTable ? PerftTable + (key & PerftTableMask) : NULL;
+
+    if (e)
+    {
+        uint64_t data = e->data;
+        if ((e->check ^ data) == key && int(data & 0xFF) == depth)
+            return int64_t(data >> 8);
+    }
+
+    int64_t sum = 0;
+    CheckInfo ci(pos);
+
+    for (MoveStack* cur = mlist; cur != last; cur++)
+    {
+        pos.do_move(cur->move, st, ci, pos.move_is_check(cur->move, ci));
+        sum += perft_count(pos, depth - 1);
+        pos.undo_move(cur->move);
+    }
+
+    if (e)
+    {
+        uint64_t data = (uint64_t(sum) << 8) | depth;
+        e->data = data;
+        e->check = key ^ data;
+    }
+    return sum;
+  }
+
+
+  // perft_loop() is run by each thread of perft(). It takes the root moves
+  // not yet taken by another thread and counts the nodes below them.
+
+  void perft_loop(int threadID) {
+
+    Position pos(*PerftRoot, threadID);
+    CheckInfo ci(pos);
+    StateInfo st;
+
+    while (true)
+    {
+        lock_grab(&PerftLock);
+        int idx = PerftNextMove++;
+        lock_release(&PerftLock);
+
+        if (idx >= PerftMovesCount)
+            break;
+
+        Move m = PerftMoves[idx].move;
+        pos.do_move(m, st, ci, pos.move_is_check(m, ci));
+        PerftCounts[idx] = PerftDepth > 1 ? perft_count(pos, PerftDepth - 1) : 1;
+        pos.undo_move(m);
+    }
+  }
+
+#if !defined(_MSC_VER)
+
+  void* perft_thread(void* threadID) {
 
-  void print_pv_info(const Position& pos, Move pv[], Value alpha, Value beta, Value value) {
+    perft_loop(int(intptr_t(threadID)));
+    return NULL;
+  }
 
-    cout << "info depth " << Iteration
-         << " score "     << value_to_string(value)
-         << (value >= beta ? " lowerbound" : value <= alpha ? " upperbound" : "")
-         << " time "  << current_search_time()
-         << " nodes " << TM.nodes_searched()
-         << " nps "   << nps()
-         << " pv ";
+#else
 
-    for (Move* m = pv; *m != MOVE_NONE; m++)
-        cout << *m << " ";
+  DWORD WINAPI perft_thread(LPVOID threadID) {
 
-    cout << endl;
+    perft_loop(int(intptr_t(threadID)));
+    return 0;
+  }
 
-#if !defined(IPHONE_GLAURUNG)
-    if (UseLogFile)
-    {
-        ValueType t = value >= beta  ? VALUE_TYPE_LOWER :
-                      value <= alpha ? VALUE_TYPE_UPPER : VALUE_TYPE_EXACT;
+#endif
+
+
+  // timer_thread() is the function run by the timer thread of a search, the
+  // parameter is the search context.
+
+#if !defined(_MSC_VER)
+
+  void* timer_thread(void* ctx) {
+
+    ((SearchContext*)ctx)->timer_loop();
+    return NULL;
+  }
 
-        LogFile << pretty_pv(pos, current_search_time(), Iteration,
-                             TM.nodes_searched(), value, t, pv) << endl;
-    }
 #else
-    std::stringstream str;
-    bool iAmWhite = (pos.side_to_move() == WHITE);
-    str << Iteration << " ";
-    if ((value >= beta && iAmWhite) || (value <= alpha && !iAmWhite))
-      str << ">";
-    else if ((value >= beta && !iAmWhite) || (value <= alpha && iAmWhite))
-      str << "<";
-    if (abs(value) >= VALUE_MATE - 200) {
-      if (value < 0)
-        str << (iAmWhite? '-' : '+') << '#'
-            << (VALUE_MATE + value) / 2;
-      else
-        str << (iAmWhite? '+' : '-') << '#'
-            << (VALUE_MATE - value + 1) / 2;
-    }
-    else
-      str << (((iAmWhite && value > 0) || (!iAmWhite && value < 0))? "+" : "")
-          << std::setiosflags(std::ios::fixed) << std::setprecision(1)
-          << value_to_centipawns(iAmWhite? value : -value) / 100.0;
-    str << " " << line_to_san(pos, pv, 0, false, 0);
-    pv_to_ui(str.str());
-#endif
 
+  DWORD WINAPI timer_thread(LPVOID ctx) {
+
+    ((SearchContext*)ctx)->timer_loop();
+    return 0;
   }
 
+#endif
+
 
   // init_thread() is the function which is called when a new thread is
   // launched. It simply calls the idle_loop() function with the supplied
@@ -2400,7 +3554,10 @@ namespace {
 
   void* init_thread(void *threadID) {
 
-    TM.idle_loop(*(int*)threadID, NULL);
+    int id = *(int*)threadID;
+
+    ThreadOwner[id]->init_thread_data(id);
+    ThreadOwner[id]->idle_loop(id, NULL);
     return NULL;
   }
 
@@ -2408,7 +3565,10 @@ namespace {
 
   DWORD WINAPI init_thread(LPVOID threadID) {
 
-    TM.idle_loop(*(int*)threadID, NULL);
+    int id = *(int*)threadID;
+
+    ThreadOwner[id]->init_thread_data(id);
+    ThreadOwner[id]->idle_loop(id, NULL);
     return 0;
   }
 
@@ -2417,26 +3577,48 @@ namespace {
 
   /// The ThreadsManager class
 
+  // ThreadsManager c'tor. The threads are launched by init_threads().
+
+  ThreadsManager::ThreadsManager(SearchContext* owner) : Owner(owner) {
+
+    FirstThread = ActiveThreads = ThreadsCount = 0;
+    AllThreadsShouldExit = AllThreadsShouldSleep = false;
+    HelpersRootPosition = NULL;
+    threads = Threads;
+    memset(SplitPointStack, 0, sizeof(SplitPointStack));
+    BindThreads = false;
+  }
+
+
   // resetNodeCounters(), resetBetaCounters(), searched_nodes() and
   // get_beta_counters() are getters/setters for the per thread
-  // counters used to sort the moves at root.
+  // counters used to sort the moves at root. get_split_latency()
+  // returns how many times the slaves joined a split point during
+  // the current search, and the total time they took to start.
+  // get_thread_stats() and print_thread_stats(), used for the search
+  // log, report the work of each thread.
 
   void ThreadsManager::resetNodeCounters() {
 
-    for (int i = 0; i < MAX_THREADS; i++)
-        threads[i].nodes = 0ULL;
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
+    {
+        threads[i].nodes = threads[i].splitJoins = threads[i].splitJoinTime = 0ULL;
+        threads[i].lateJoins = threads[i].idleTime = 0ULL;
+        threads[i].throttleStart = threads[i].throttleSleep = 0;
+        threads[i].throttleNodes = 0;
+    }
   }
 
   void ThreadsManager::resetBetaCounters() {
 
-    for (int i = 0; i < MAX_THREADS; i++)
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
         threads[i].betaCutOffs[WHITE] = threads[i].betaCutOffs[BLACK] = 0ULL;
   }
 
   int64_t ThreadsManager::nodes_searched() const {
 
     int64_t result = 0ULL;
-    for (int i = 0; i < ActiveThreads; i++)
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
         result += threads[i].nodes;
 
     return result;
@@ -2445,21 +3627,53 @@ namespace {
   void ThreadsManager::get_beta_counters(Color us, int64_t& our, int64_t& their) const {
 
     our = their = 0UL;
-    for (int i = 0; i < MAX_THREADS; i++)
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
     {
         our += threads[i].betaCutOffs[us];
         their += threads[i].betaCutOffs[opposite_color(us)];
     }
   }
 
+  void ThreadsManager::get_thread_stats(int threadID, int64_t& nodes, int64_t& lateJoins, int64_t& idleTime) const {
+
+    nodes = threads[threadID].nodes;
+    lateJoins = threads[threadID].lateJoins;
+    idleTime = threads[threadID].idleTime;
+  }
+
+  void ThreadsManager::print_thread_stats(std::ostream& os) const {
+
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
+        os << "\nThread " << i
+           << " nodes " << threads[i].nodes
+           << " late joins " << threads[i].lateJoins
+           << " idle (ms) " << threads[i].idleTime / 1000;
+  }
+
+  void ThreadsManager::get_split_latency(int64_t& joins, int64_t& joinTime) const {
+
+    joins = joinTime = 0;
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
+    {
+        joins += threads[i].splitJoins;
+        joinTime += threads[i].splitJoinTime;
+    }
+  }
+
 
   // idle_loop() is where the threads are parked when they have no work to do.
   // The parameter 'sp', if non-NULL, is a pointer to an active SplitPoint
-  // object for which the current thread is the master.
+  // object for which the current thread is the master. A thread without work
+  // polls for it IdleSpinCount times, so that it is quick to join a split
+  // point, then parks itself on its own condition until it is woken up by
+  // wake_thread().
 
   void ThreadsManager::idle_loop(int threadID, SplitPoint* sp) {
 
-    assert(threadID >= 0 && threadID < MAX_THREADS);
+    assert(threadID >= FirstThread && threadID < FirstThread + ThreadsCount);
+
+    int spins = 0;
+    int64_t idleStart = get_monotonic_time_us();
 
     while (true)
     {
@@ -2472,71 +3686,292 @@ namespace {
             return;
         }
 
-        // If we are not thinking, wait for a condition to be signaled
-        // instead of wasting CPU time polling for work.
-        while (AllThreadsShouldSleep || threadID >= ActiveThreads)
+        // If we are not thinking, wait to be woken up instead of
+        // wasting CPU time polling for work.
+        while ((AllThreadsShouldSleep || !thread_is_active(threadID)) && !AllThreadsShouldExit)
         {
             assert(!sp);
-            assert(threadID != 0);
+            assert(threadID != FirstThread);
             threads[threadID].state = THREAD_SLEEPING;
-
-#if !defined(_MSC_VER)
-            lock_grab(&WaitLock);
-            if (AllThreadsShouldSleep || threadID >= ActiveThreads)
-                pthread_cond_wait(&WaitCond, &WaitLock);
-            lock_release(&WaitLock);
-#else
-            WaitForSingleObject(SitIdleEvent[threadID], INFINITE);
-#endif
+            park(threadID, sp);
+            idleStart = get_monotonic_time_us();
         }
 
         // If thread has just woken up, mark it as available
         if (threads[threadID].state == THREAD_SLEEPING)
             threads[threadID].state = THREAD_AVAILABLE;
 
-        // If this thread has been assigned work, launch a search
+        SplitPoint* tsp = NULL;
+        bool hasWork = false;
+
+        // If this thread has been assigned work, launch a search. Otherwise
+        // look for an active split point that could use some help.
         if (threads[threadID].state == THREAD_WORKISWAITING)
         {
             assert(!AllThreadsShouldExit && !AllThreadsShouldSleep);
 
+            // Read the split point only after the state that published it
+            memory_barrier();
+
             threads[threadID].state = THREAD_SEARCHING;
+            tsp = threads[threadID].splitPoint;
+            hasWork = true;
+
+            if (tsp && tsp->master != threadID)
+            {
+                threads[threadID].splitJoins++;
+                threads[threadID].splitJoinTime += get_monotonic_time_us() - tsp->startTime;
+            }
+        }
+        else if (   threads[threadID].state == THREAD_AVAILABLE
+                 && !AllThreadsShouldSleep
+                 && (tsp = join_split_point(threadID)) != NULL)
+        {
+            threads[threadID].lateJoins++;
+            hasWork = true;
+        }
 
-            if (threads[threadID].splitPoint->pvNode)
-                sp_search<PV>(threads[threadID].splitPoint, threadID);
+        if (hasWork)
+        {
+            threads[threadID].idleTime += get_monotonic_time_us() - idleStart;
+
+            // A NULL split point means that we are a Lazy SMP helper or a
+            // parallel MultiPV worker.
+            if (!tsp && Owner->ParallelMultiPV)
+                Owner->multipv_worker(*HelpersRootPosition, threadID);
+            else if (!tsp)
+                Owner->helper_id_loop(*HelpersRootPosition, threadID);
+            else if (tsp->pvNode)
+                Owner->sp_search<PV>(tsp, threadID);
             else
-                sp_search<NonPV>(threads[threadID].splitPoint, threadID);
+                Owner->sp_search<NonPV>(tsp, threadID);
 
             assert(threads[threadID].state == THREAD_SEARCHING);
 
             threads[threadID].state = THREAD_AVAILABLE;
+            idleStart = get_monotonic_time_us();
+            spins = 0;
+
+            // The last slave to finish wakes up the master, that could be parked
+            if (tsp && tsp->master != threadID && split_point_finished(tsp))
+                wake_thread(tsp->master);
         }
 
         // If this thread is the master of a split point and all slaves have
         // finished their work at this split point, return from the idle loop.
-        int i = 0;
-        for ( ; sp && i < ActiveThreads && !sp->slaves[i]; i++) {}
-
-        if (i == ActiveThreads)
+        // The check is repeated under lock, where late joiners book themselves,
+        // and the split point is closed so that nobody can join it anymore.
+        if (sp && split_point_finished(sp))
         {
-            // Because sp->slaves[] is reset under lock protection,
-            // be sure sp->lock has been released before to return.
             lock_grab(&(sp->lock));
+
+            bool finished = split_point_finished(sp);
+            if (finished)
+                sp->allSlavesSearching = false;
+
             lock_release(&(sp->lock));
 
-            assert(threads[threadID].state == THREAD_AVAILABLE);
+            if (finished)
+            {
+                assert(threads[threadID].state == THREAD_AVAILABLE);
 
-            threads[threadID].state = THREAD_SEARCHING;
-            return;
+                threads[threadID].idleTime += get_monotonic_time_us() - idleStart;
+                threads[threadID].state = THREAD_SEARCHING;
+                return;
+            }
+        }
+
+        // Nothing to do for a while, stop burning CPU time
+        if (++spins > IdleSpinCount && threads[threadID].state == THREAD_AVAILABLE)
+        {
+            park(threadID, sp);
+            spins = 0;
+        }
+    }
+  }
+
+
+  // help_split_point() is called by the main thread in parallel MultiPV mode
+  // when there are no root moves left, to join a split point of a helper that
+  // is still searching, as an idle thread would do. The thread is marked as
+  // available only for the time of the attempt, so it could also be booked by
+  // a splitting helper, and then searches the split point it is given. Returns
+  // false if there was nothing to do.
+
+  bool ThreadsManager::help_split_point(int threadID) {
+
+    assert(threads[threadID].state == THREAD_SEARCHING);
+
+    threads[threadID].state = THREAD_AVAILABLE;
+
+    SplitPoint* tsp = join_split_point(threadID);
+
+    if (tsp)
+        threads[threadID].lateJoins++;
+
+    else if (!compare_and_swap((volatile int*)&threads[threadID].state, THREAD_AVAILABLE, THREAD_SEARCHING))
+    {
+        // A helper has booked us in the meantime, wait for its split point
+        while (threads[threadID].state != THREAD_WORKISWAITING) {}
+
+        memory_barrier();
+
+        threads[threadID].state = THREAD_SEARCHING;
+        tsp = threads[threadID].splitPoint;
+    }
+
+    if (!tsp)
+        return false;
+
+    if (tsp->pvNode)
+        Owner->sp_search<PV>(tsp, threadID);
+    else
+        Owner->sp_search<NonPV>(tsp, threadID);
+
+    assert(threads[threadID].state == THREAD_SEARCHING);
+
+    // The last slave to finish wakes up the master, that could be parked
+    if (split_point_finished(tsp))
+        wake_thread(tsp->master);
+
+    return true;
+  }
+
+
+  // split_point_finished() returns true when all the slaves, master
+  // included, have finished their work at the split point.
+
+  bool ThreadsManager::split_point_finished(const SplitPoint* sp) const {
+
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
+        if (sp->slaves[i])
+            return false;
+
+    return true;
+  }
+
+
+  // join_split_point() is called by an idle thread to join, as a late slave,
+  // an active split point of another thread that has still moves to search
+  // and room for one more slave. The deepest such split point is chosen. A
+  // master waiting on its own split point can only join the newest split
+  // point of one of its slaves, as in thread_is_available(). The candidate
+  // is checked again under its lock, where also the thread books itself,
+  // so that its master cannot have left it. Returns the joined split point
+  // or NULL.
+
+  SplitPoint* ThreadsManager::join_split_point(int threadID) {
+
+    SplitPoint* best = NULL;
+    int ownSplitPoints = threads[threadID].activeSplitPoints;
+
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
+    {
+        int n = threads[i].activeSplitPoints;
+
+        if (   i == threadID
+            || n == 0
+            || (ownSplitPoints && !SplitPointStack[threadID][ownSplitPoints - 1].slaves[i]))
+            continue;
+
+        for (int j = (ownSplitPoints ? n - 1 : 0); j < n; j++)
+        {
+            SplitPoint* sp = &SplitPointStack[i][j];
+
+            if (sp->allSlavesSearching && (!best || sp->depth > best->depth))
+                best = sp;
         }
     }
+
+    if (!best)
+        return NULL;
+
+    lock_grab(&(best->lock));
+
+    int workersCnt = 1; // The master is not in slaves[]
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
+        workersCnt += best->slaves[i];
+
+    bool joined =   best->allSlavesSearching
+                 && !best->stopRequest
+                 && workersCnt < Owner->MaxThreadsPerSplitPoint
+                 && compare_and_swap((volatile int*)&threads[threadID].state, THREAD_AVAILABLE, THREAD_SEARCHING);
+
+    if (joined)
+    {
+        best->slaves[threadID] = 1;
+        threads[threadID].splitPoint = best;
+    }
+
+    lock_release(&(best->lock));
+
+    return joined ? best : NULL;
+  }
+
+
+  // should_wake_up() returns true if a parked thread has something to do:
+  // a search to start, a split point of its own that is finished, or it is
+  // time to think, to go to sleep at the end of the search, or to exit.
+
+  bool ThreadsManager::should_wake_up(int threadID, const SplitPoint* sp) const {
+
+    ThreadState state = threads[threadID].state;
+
+    return   AllThreadsShouldExit
+          || state == THREAD_WORKISWAITING
+          || (state == THREAD_SLEEPING && !AllThreadsShouldSleep && thread_is_active(threadID))
+          || (state == THREAD_AVAILABLE && AllThreadsShouldSleep && !sp)
+          || (sp && split_point_finished(sp));
+  }
+
+
+  // park() suspends the thread until wake_thread() is called for it. The
+  // wake up condition is checked again under the thread's lock, and
+  // wake_thread() signals under the same lock after the condition has
+  // changed, so that a wake up can never be lost.
+
+  void ThreadsManager::park(int threadID, const SplitPoint* sp) {
+
+    Thread& t = threads[threadID];
+
+#if !defined(_MSC_VER)
+    lock_grab(&t.sleepLock);
+    if (!should_wake_up(threadID, sp))
+        pthread_cond_wait(&t.sleepCond, &t.sleepLock);
+    lock_release(&t.sleepLock);
+#else
+    // The event stays signaled until a thread waits on it, so a SetEvent()
+    // called after the check is not lost.
+    if (!should_wake_up(threadID, sp))
+        WaitForSingleObject(t.sleepEvent, INFINITE);
+#endif
+  }
+
+
+  // wake_thread() wakes up a thread if it is parked. It must be called
+  // after the change that the thread should see when woken up.
+
+  void ThreadsManager::wake_thread(int threadID) {
+
+    Thread& t = threads[threadID];
+
+#if !defined(_MSC_VER)
+    lock_grab(&t.sleepLock);
+    pthread_cond_signal(&t.sleepCond);
+    lock_release(&t.sleepLock);
+#else
+    SetEvent(t.sleepEvent);
+#endif
   }
 
 
-  // init_threads() is called during startup. It launches all helper threads,
-  // and initializes the split point stack and the global locks and condition
-  // objects.
+  // init_threads() is called when a search context is created. It books a
+  // slice of threadsCount threads in Threads[], or the biggest free one if
+  // there is not room enough, initializes their data and locks, then launches
+  // all helper threads. The calling thread is the main thread of the context.
+  // It is called again when a bigger pool is needed.
 
-  void ThreadsManager::init_threads() {
+  void ThreadsManager::init_threads(int threadsCount) {
 
     volatile int i;
     bool ok;
@@ -2545,21 +3980,61 @@ namespace {
     pthread_t pthread[1];
 #endif
 
-    // Initialize global locks
-    lock_init(&MPLock, NULL);
-    lock_init(&WaitLock, NULL);
+    assert(threadsCount > 0 && threadsCount <= MAX_THREADS);
+
+    bool wasBound = BindThreads;
+
+    BindThreads = get_option_value_bool("Bind Threads");
+
+    lock_grab(&ThreadOwnerLock);
 
+    FirstThread = ThreadsCount = 0;
+    for (int first = 0; first < MAX_THREADS && ThreadsCount < threadsCount; first++)
+    {
+        int n = 0;
+        while (first + n < MAX_THREADS && !ThreadOwner[first + n] && n < threadsCount)
+            n++;
+
+        if (n > ThreadsCount)
+        {
+            FirstThread = first;
+            ThreadsCount = n;
+        }
+        first += n;
+    }
+
+    for (i = FirstThread; i < FirstThread + ThreadsCount; i++)
+        ThreadOwner[i] = this;
+
+    lock_release(&ThreadOwnerLock);
+
+    if (ThreadsCount == 0)
+    {
+        cout << "No free thread to search" << endl;
+        Application::exit_with_failure();
+    }
+
+    for (i = FirstThread; i < FirstThread + ThreadsCount; i++)
+        threads[i] = Thread();
+
+    // New threads inherit the CPU affinity of their creator, so unbind the
+    // main thread before to launch them.
+    if (wasBound && !BindThreads)
+        bind_this_thread(-1);
+
+    // Initialize per thread locks
+    for (i = FirstThread; i < FirstThread + ThreadsCount; i++)
+    {
+        lock_init(&threads[i].sleepLock, NULL);
 #if !defined(_MSC_VER)
-    pthread_cond_init(&WaitCond, NULL);
+        pthread_cond_init(&threads[i].sleepCond, NULL);
 #else
-    for (i = 0; i < MAX_THREADS; i++)
-        SitIdleEvent[i] = CreateEvent(0, FALSE, FALSE, 0);
+        threads[i].sleepEvent = CreateEvent(0, FALSE, FALSE, 0);
 #endif
+    }
 
-    // Initialize SplitPointStack locks
-    for (i = 0; i < MAX_THREADS; i++)
-        for (int j = 0; j < ACTIVE_SPLIT_POINTS_MAX; j++)
-            lock_init(&(SplitPointStack[i][j].lock), NULL);
+    // The main thread sets up its own data, the helpers do it when launched
+    init_thread_data(FirstThread);
 
     // Will be set just before program exits to properly end the threads
     AllThreadsShouldExit = false;
@@ -2569,12 +4044,12 @@ namespace {
 
     // All threads except the main thread should be initialized to THREAD_AVAILABLE
     ActiveThreads = 1;
-    threads[0].state = THREAD_SEARCHING;
-    for (i = 1; i < MAX_THREADS; i++)
+    threads[FirstThread].state = THREAD_SEARCHING;
+    for (i = FirstThread + 1; i < FirstThread + ThreadsCount; i++)
         threads[i].state = THREAD_AVAILABLE;
 
     // Launch the helper threads
-    for (i = 1; i < MAX_THREADS; i++)
+    for (i = FirstThread + 1; i < FirstThread + ThreadsCount; i++)
     {
 
 #if !defined(_MSC_VER)
@@ -2595,29 +4070,76 @@ namespace {
   }
 
 
-  // exit_threads() is called when the program exits. It makes all the
-  // helper threads exit cleanly.
+  // init_thread_data() is called by each thread, before to enter the idle
+  // loop, to set up its own split point stack and evaluation tables. When
+  // the "Bind Threads" option is set the thread first pins itself to a CPU,
+  // so that this data is placed by the OS on the memory of the thread's NUMA
+  // node, where it is first touched.
+
+  void ThreadsManager::init_thread_data(int threadID) {
+
+    if (BindThreads)
+        bind_this_thread(threadID);
+
+    // Split points are not open to late joiners until they are set up
+    SplitPointStack[threadID] = new SplitPoint[ACTIVE_SPLIT_POINTS_MAX];
+    for (int j = 0; j < ACTIVE_SPLIT_POINTS_MAX; j++)
+    {
+        lock_init(&(SplitPointStack[threadID][j].lock), NULL);
+        SplitPointStack[threadID][j].allSlavesSearching = false;
+    }
+
+    init_eval(threadID);
+  }
+
+
+  // exit_threads() is called when the program exits, or before relaunching
+  // a bigger pool. It makes all the helper threads exit cleanly and frees
+  // the thread data.
 
   void ThreadsManager::exit_threads() {
 
-    ActiveThreads = MAX_THREADS;  // HACK
+    ActiveThreads = ThreadsCount;  // HACK
     AllThreadsShouldSleep = true;  // HACK
     wake_sleeping_threads();
 
-    // This makes the threads to exit idle_loop()
+    // This makes the threads to exit idle_loop(), also the parked ones
     AllThreadsShouldExit = true;
 
+    for (int i = FirstThread + 1; i < FirstThread + ThreadsCount; i++)
+        wake_thread(i);
+
     // Wait for thread termination
-    for (int i = 1; i < MAX_THREADS; i++)
+    for (int i = FirstThread + 1; i < FirstThread + ThreadsCount; i++)
         while (threads[i].state != THREAD_TERMINATED) {}
 
     // Now we can safely destroy the locks
-    for (int i = 0; i < MAX_THREADS; i++)
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
+    {
         for (int j = 0; j < ACTIVE_SPLIT_POINTS_MAX; j++)
             lock_destroy(&(SplitPointStack[i][j].lock));
 
-    lock_destroy(&WaitLock);
-    lock_destroy(&MPLock);
+        delete [] SplitPointStack[i];
+    }
+
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
+    {
+        lock_destroy(&threads[i].sleepLock);
+#if !defined(_MSC_VER)
+        pthread_cond_destroy(&threads[i].sleepCond);
+#else
+        CloseHandle(threads[i].sleepEvent);
+#endif
+    }
+
+    lock_grab(&ThreadOwnerLock);
+
+    for (int i = FirstThread; i < FirstThread + ThreadsCount; i++)
+        ThreadOwner[i] = NULL;
+
+    lock_release(&ThreadOwnerLock);
+
+    ActiveThreads = ThreadsCount = 0;
   }
 
 
@@ -2627,7 +4149,7 @@ namespace {
 
   bool ThreadsManager::thread_should_stop(int threadID) const {
 
-    assert(threadID >= 0 && threadID < ActiveThreads);
+    assert(thread_is_active(threadID));
 
     SplitPoint* sp;
 
@@ -2646,8 +4168,8 @@ namespace {
 
   bool ThreadsManager::thread_is_available(int slave, int master) const {
 
-    assert(slave >= 0 && slave < ActiveThreads);
-    assert(master >= 0 && master < ActiveThreads);
+    assert(thread_is_active(slave));
+    assert(thread_is_active(master));
     assert(ActiveThreads > 1);
 
     if (threads[slave].state != THREAD_AVAILABLE || slave == master)
@@ -2679,10 +4201,10 @@ namespace {
 
   bool ThreadsManager::available_thread_exists(int master) const {
 
-    assert(master >= 0 && master < ActiveThreads);
+    assert(thread_is_active(master));
     assert(ActiveThreads > 1);
 
-    for (int i = 0; i < ActiveThreads; i++)
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
         if (thread_is_available(i, master))
             return true;
 
@@ -2711,25 +4233,25 @@ namespace {
     assert(*alpha < beta);
     assert(beta <= VALUE_INFINITE);
     assert(depth > Depth(0));
-    assert(p.thread() >= 0 && p.thread() < ActiveThreads);
+    assert(thread_is_active(p.thread()));
     assert(ActiveThreads > 1);
 
     int master = p.thread();
 
-    lock_grab(&MPLock);
-
     // If no other thread is available to help us, or if we have too many
     // active split points, don't split.
     if (   !available_thread_exists(master)
         || threads[master].activeSplitPoints >= ACTIVE_SPLIT_POINTS_MAX)
-    {
-        lock_release(&MPLock);
         return;
-    }
 
-    // Pick the next available split point object from the split point stack
+    // Pick the next available split point object from the split point stack.
+    // There is no global lock: the split point is set up under its own lock,
+    // that late joiners must grab, and slaves are booked one by one with an
+    // atomic state change.
     SplitPoint* splitPoint = &SplitPointStack[master][threads[master].activeSplitPoints];
 
+    lock_grab(&(splitPoint->lock));
+
     // Initialize the split point object
     splitPoint->parent = threads[master].splitPoint;
     splitPoint->stopRequest = false;
@@ -2743,8 +4265,10 @@ namespace {
     splitPoint->mp = mp;
     splitPoint->moveCount = *moveCount;
     splitPoint->pos = &p;
+    splitPoint->master = master;
     splitPoint->parentSstack = ss;
-    for (int i = 0; i < ActiveThreads; i++)
+    splitPoint->allSlavesSearching = true;
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
         splitPoint->slaves[i] = 0;
 
     threads[master].splitPoint = splitPoint;
@@ -2754,32 +4278,51 @@ namespace {
     assert(threads[master].state != THREAD_AVAILABLE);
 
     int workersCnt = 1; // At least the master is included
-
-    // Allocate available threads setting state to THREAD_BOOKED
-    for (int i = 0; !Fake && i < ActiveThreads && workersCnt < MaxThreadsPerSplitPoint; i++)
-        if (thread_is_available(i, master))
+    bool booked[MAX_THREADS] = { false };
+
+    // Allocate available threads setting state to THREAD_BOOKED. Another
+    // master, or the thread itself joining some split point, could take
+    // the thread first, in that case the compare and swap fails.
+    for (int i = FirstThread; !Fake && i < FirstThread + ActiveThreads && workersCnt < Owner->MaxThreadsPerSplitPoint; i++)
+        if (   thread_is_available(i, master)
+            && compare_and_swap((volatile int*)&threads[i].state, THREAD_AVAILABLE, THREAD_BOOKED))
         {
-            threads[i].state = THREAD_BOOKED;
             threads[i].splitPoint = splitPoint;
             splitPoint->slaves[i] = 1;
+            booked[i] = true;
             workersCnt++;
         }
 
-    assert(Fake || workersCnt > 1);
+    // All the available threads could have been taken first. Then give up
+    // the split point, late joiners check allSlavesSearching under the lock.
+    if (!Fake && workersCnt == 1)
+    {
+        splitPoint->allSlavesSearching = false;
+        threads[master].activeSplitPoints--;
+        threads[master].splitPoint = splitPoint->parent;
+        lock_release(&(splitPoint->lock));
+        return;
+    }
 
     // We can release the lock because slave threads are already booked and master is not available
-    lock_release(&MPLock);
+    lock_release(&(splitPoint->lock));
+
+    // The split point must be visible to the slaves before their new state
+    splitPoint->startTime = get_monotonic_time_us();
+    memory_barrier();
 
     // Tell the threads that they have work to do. This will make them leave
-    // their idle loop. But before copy search stack tail for each thread.
-    for (int i = 0; i < ActiveThreads; i++)
-        if (i == master || splitPoint->slaves[i])
+    // their idle loop, waking them up if they are parked. Late joiners could
+    // be in slaves[] already, but they are searching on their own.
+    for (int i = FirstThread; i < FirstThread + ActiveThreads; i++)
+        if (i == master || booked[i])
         {
-            memcpy(splitPoint->sstack[i], ss - 1, 4 * sizeof(SearchStack));
-
             assert(i == master || threads[i].state == THREAD_BOOKED);
 
             threads[i].state = THREAD_WORKISWAITING; // This makes the slave to exit from idle_loop()
+
+            if (i != master)
+                wake_thread(i);
         }
 
     // Everything is set up. The master thread enters the idle loop, from
@@ -2791,14 +4334,14 @@ namespace {
 
     // We have returned from the idle loop, which means that all threads are
     // finished. Update alpha and bestValue, and return.
-    lock_grab(&MPLock);
+    lock_grab(&(splitPoint->lock));
 
     *alpha = splitPoint->alpha;
     *bestValue = splitPoint->bestValue;
     threads[master].activeSplitPoints--;
     threads[master].splitPoint = splitPoint->parent;
 
-    lock_release(&MPLock);
+    lock_release(&(splitPoint->lock));
   }
 
 
@@ -2812,18 +4355,8 @@ namespace {
 
     AllThreadsShouldSleep = false;
 
-    if (ActiveThreads == 1)
-        return;
-
-#if !defined(_MSC_VER)
-    pthread_mutex_lock(&WaitLock);
-    pthread_cond_broadcast(&WaitCond);
-    pthread_mutex_unlock(&WaitLock);
-#else
-    for (int i = 1; i < MAX_THREADS; i++)
-        SetEvent(SitIdleEvent[i]);
-#endif
-
+    for (int i = FirstThread + 1; i < FirstThread + ActiveThreads; i++)
+        wake_thread(i);
   }
 
 
@@ -2835,15 +4368,71 @@ namespace {
 
     assert(!AllThreadsShouldSleep);
 
-    // This makes the threads to go to sleep
+    // This makes the threads to go to sleep, the parked ones are woken up
+    // so that they leave their idle loop as sleeping threads.
     AllThreadsShouldSleep = true;
+
+    for (int i = FirstThread + 1; i < FirstThread + ActiveThreads; i++)
+        wake_thread(i);
+  }
+
+
+  // start_helpers() is used in Lazy SMP mode to launch all the active helper
+  // threads on the root position, and in parallel MultiPV mode to launch the
+  // root move workers. We wait for each helper to be woken up and
+  // available before to assign it the work, so that the state change cannot
+  // be lost while the thread is still leaving its sleeping loop.
+
+  void ThreadsManager::start_helpers(const Position* pos) {
+
+    assert(!AllThreadsShouldSleep);
+
+    HelpersRootPosition = pos;
+
+    for (int i = FirstThread + 1; i < FirstThread + ActiveThreads; i++)
+    {
+        while (threads[i].state != THREAD_AVAILABLE) {}
+
+        threads[i].splitPoint = NULL;
+        memory_barrier();
+        threads[i].state = THREAD_WORKISWAITING; // This makes the helper to exit from idle_loop()
+        wake_thread(i);
+    }
+  }
+
+
+  // wait_for_helpers() waits until all the Lazy SMP helpers have returned to
+  // the idle loop. It is called after AbortSearch has been raised.
+
+  void ThreadsManager::wait_for_helpers() const {
+
+    assert(Owner->AbortSearch);
+
+    while (!helpers_finished()) {}
+  }
+
+
+  // helpers_finished() returns true when all the helpers are back in the idle
+  // loop. A helper out of work could join a split point of another one later,
+  // but the scan is in thread order and a helper is available only when all
+  // its split points are finished, so once all helpers have been seen
+  // available no work is left.
+
+  bool ThreadsManager::helpers_finished() const {
+
+    for (int i = FirstThread + 1; i < FirstThread + ActiveThreads; i++)
+        if (threads[i].state != THREAD_AVAILABLE)
+            return false;
+
+    return true;
   }
 
   /// The RootMoveList class
 
-  // RootMoveList c'tor
+  // RootMoveList c'tor. Moves are scored with a quick search in the given
+  // context.
 
-  RootMoveList::RootMoveList(Position& pos, Move searchMoves[]) : count(0) {
+  RootMoveList::RootMoveList(SearchContext* ctx, Position& pos, Move searchMoves[]) : count(0) {
 
     SearchStack ss[PLY_MAX_PLUS_2];
     MoveStack mlist[MaxRootMoves];
@@ -2868,7 +4457,7 @@ namespace {
         init_ss_array(ss, PLY_MAX_PLUS_2);
         pos.do_move(cur->move, st);
         moves[count].move = cur->move;
-        moves[count].score = -qsearch<PV>(pos, ss+1, -VALUE_INFINITE, VALUE_INFINITE, Depth(0), 1);
+        moves[count].score = -ctx->qsearch<PV>(pos, ss+1, -VALUE_INFINITE, VALUE_INFINITE, Depth(0), 1);
         moves[count].pv[0] = cur->move;
         moves[count].pv[1] = MOVE_NONE;
         pos.undo_move(cur->move);
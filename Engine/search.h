@@ -58,6 +58,7 @@ struct SearchStack {
   Move killers[KILLER_MAX];
   Depth reduction;
   Value eval;
+  bool lazyEval; // eval is only a bound, see evaluate()
   bool skipNullMove;
 
   void init();
@@ -65,6 +66,25 @@ struct SearchStack {
 };
 
 
+/// SearchContext holds the state of a search, see search.cpp. The UCI
+/// searches use a default context, other contexts can search at the same
+/// time on other positions with their own threads.
+class SearchContext;
+class TranspositionTable;
+
+
+/// The SearchResult struct is the outcome of a search: the principal
+/// variation, ended by MOVE_NONE, its score, the depth of the last completed
+/// iteration, and the nodes and the time in milliseconds spent.
+struct SearchResult {
+  Move pv[PLY_MAX_PLUS_2];
+  Value score;
+  int depth;
+  int64_t nodes;
+  int time;
+};
+
+
 ////
 //// Prototypes
 ////
@@ -75,8 +95,18 @@ extern void exit_threads();
 extern bool think(const Position &pos, bool infinite, bool ponder, int side_to_move,
                   int time[], int increment[], int movesToGo, int maxDepth,
                   int maxNodes, int maxTime, Move searchMoves[]);
-extern int perft(Position &pos, Depth depth);
+extern SearchContext* new_search_context(int threadsCount, TranspositionTable* table = NULL);
+extern void delete_search_context(SearchContext* ctx);
+extern bool think(SearchContext* ctx, const Position &pos, bool infinite, bool ponder, int side_to_move,
+                  int time[], int increment[], int movesToGo, int maxDepth,
+                  int maxNodes, int maxTime, Move searchMoves[]);
+extern void stop_search(SearchContext* ctx);
+extern void get_search_result(SearchContext* ctx, SearchResult& result);
+extern int available_threads();
+extern int64_t perft(Position &pos, Depth depth, bool divide = false);
 extern int64_t nodes_searched();
+extern void split_latency(int64_t& joins, int64_t& joinTime);
+extern void thread_stats(int threadID, int64_t& nodes, int64_t& lateJoins, int64_t& idleTime);
 
 
 #endif // !defined(SEARCH_H_INCLUDED)
@@ -38,7 +38,9 @@
 //// Constants and variables
 ////
 
-const int MAX_THREADS = 1;
+// MAX_THREADS is only an upper bound for the "Threads" UCI option, the
+// actual number of threads is decided at runtime by ThreadsManager.
+const int MAX_THREADS = 64;
 const int ACTIVE_SPLIT_POINTS_MAX = 8;
 
 
@@ -51,22 +53,25 @@ struct SplitPoint {
   // Const data after splitPoint has been setup
   SplitPoint* parent;
   const Position* pos;
+  int master;
+  int64_t startTime; // When the slaves have been told to start, in microseconds
   Depth depth;
   bool pvNode, mateThreat;
   Value beta;
   int ply;
-  SearchStack sstack[MAX_THREADS][PLY_MAX_PLUS_2];
 
-  // Const pointers to shared data
+  // Const pointers to shared data. Each thread copies the search stack
+  // tail from parentSstack into its own local stack in sp_search().
   MovePicker* mp;
   SearchStack* parentSstack;
 
-  // Shared data
+  // Shared data, protected by the lock
   Lock lock;
   volatile Value alpha;
   volatile Value bestValue;
   volatile int moveCount;
   volatile bool stopRequest;
+  volatile bool allSlavesSearching; // false once there is no more work to join
   volatile int slaves[MAX_THREADS];
 };
 
@@ -87,7 +92,24 @@ struct Thread {
   volatile int activeSplitPoints;
   uint64_t nodes;
   uint64_t betaCutOffs[2];
+  uint64_t splitJoins;       // split points joined as a slave when they were created
+  uint64_t splitJoinTime;    // total time to start working on them, in microseconds
+  uint64_t lateJoins;        // split points joined later, see join_split_point()
+  uint64_t idleTime;         // time spent without work while searching, in microseconds
+  int64_t throttleStart;     // strength handicap, see slowdown(): when it started, in microseconds
+  int64_t throttleSleep;     // time slept since throttleStart, in microseconds
+  uint64_t throttleIdle;     // idleTime at throttleStart
+  int throttleNodes;         // nodes searched since the last check, up to SlowdownBatch
   volatile ThreadState state;
+
+  // Each thread parks on its own condition, so that it can be woken up
+  // alone when it is assigned some work.
+  Lock sleepLock;
+#if !defined(_MSC_VER)
+  pthread_cond_t sleepCond;
+#else
+  HANDLE sleepEvent;
+#endif
   unsigned char pad[64]; // set some distance among local data for each thread
 };
 
@@ -22,129 +22,601 @@
 //// Includes
 ////
 
+#if !defined(_MSC_VER)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
 #include <cassert>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#include "misc.h"
 #include "movegen.h"
+#include "thread.h"
 #include "tt.h"
+#include "ucioption.h"
 
 // The main transposition table
 TranspositionTable TT;
 
+
+////
+//// Local definitions
+////
+
+namespace {
+
+  // Entries are always aligned to a cache line. Tables of at least one large
+  // page are aligned to the large page size so that the OS can back them with
+  // transparent huge pages.
+  const size_t CacheLineSize = 64;
+  const size_t LargePageSize = 2 * 1024 * 1024;
+
+  // A saved table is a HashFileHeader padded to HashFileHeaderSize bytes,
+  // so that the entries that follow are page aligned when the file is mapped,
+  // followed by the clusters as they are in memory. The version must be
+  // increased whenever the layout of TTEntry or TTCluster changes. A shared memory table
+  // has the same layout, and its header holds the generation shared by all
+  // the attached processes, with the time it was last raised.
+  const uint32_t HashFileVersion = 2;
+  const size_t HashFileHeaderSize = 4096;
+  const char HashFileMagic[8] = "StoshTT";
+
+  struct HashFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clusterSize;
+    uint64_t clusters;
+    uint8_t generation;
+    uint32_t generationTime; // Shared table only, in seconds of the monotonic clock
+  };
+
+  // A shared generation is raised at most once every SharedGenerationPeriod
+  // seconds, whatever the number of processes starting a new search.
+  const uint32_t SharedGenerationPeriod = 10;
+
+  // ClearTask is the slice of the table zeroed by each thread in clear()
+  struct ClearTask {
+    char* mem;
+    size_t len;
+  };
+
+  // release() frees the memory of a table, obtained with mmap() if
+  // mappedSize is not zero.
+
+  void release(void* mem, size_t mappedSize) {
+
+#if !defined(_MSC_VER)
+    if (mappedSize)
+        munmap(mem, mappedSize);
+    else
+        free(mem);
+#else
+    _aligned_free(mem);
+#endif
+  }
+
+  // more_valuable() is used when migrating entries to a resized table and
+  // returns true if entry a should be kept rather than entry b: newer
+  // entries are preferred to older ones and, if equally old, deeper ones
+  // are preferred to shallower ones.
+
+  bool more_valuable(const TTEntry& a, const TTEntry& b, int generation) {
+
+    int ageA = (generation - a.generation()) & 0xF;
+    int ageB = (generation - b.generation()) & 0xF;
+
+    return ageA != ageB ? ageA < ageB : a.depth() > b.depth();
+  }
+
+#if !defined(_MSC_VER)
+
+  void* clear_slice(void* task) {
+
+    memset(((ClearTask*)task)->mem, 0, ((ClearTask*)task)->len);
+    return NULL;
+  }
+
+#else
+
+  DWORD WINAPI clear_slice(LPVOID task) {
+
+    memset(((ClearTask*)task)->mem, 0, ((ClearTask*)task)->len);
+    return 0;
+  }
+
+#endif
+
+}
+
+
 ////
 //// Functions
 ////
 
 TranspositionTable::TranspositionTable() {
 
-  size = overwrites = 0;
+  size = 0;
+  memset(stats, 0, sizeof(stats));
   entries = 0;
-  generation = 0;
+  mem = NULL;
+  mappedSize = 0;
+  largePages = false;
+  localGeneration = 0;
+  generation = &localGeneration;
 }
 
 TranspositionTable::~TranspositionTable() {
 
-  delete [] entries;
+  free_entries();
 }
 
 
-/// TranspositionTable::set_size sets the size of the transposition table,
-/// measured in megabytes.
+/// TranspositionTable::allocate() allocates the memory for the entries. When
+/// "Use Large Pages" is set we first try to get explicit huge pages with
+/// mmap(MAP_HUGETLB), then fall back to a large page aligned allocation that
+/// the kernel can back with transparent huge pages.
+
+void TranspositionTable::allocate(size_t bytes) {
+
+  mappedSize = 0;
+
+#if defined(MAP_HUGETLB)
+  if (largePages)
+  {
+      size_t len = (bytes + LargePageSize - 1) & ~(LargePageSize - 1);
+      mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (mem != MAP_FAILED)
+      {
+          entries = (TTCluster*)mem;
+          mappedSize = len;
+          return;
+      }
+      std::cout << "info string Large pages not available, falling back to normal pages" << std::endl;
+  }
+#endif
+
+#if defined(_MSC_VER)
+  entries = (TTCluster*)(mem = _aligned_malloc(bytes, CacheLineSize));
+#else
+  size_t alignment = (bytes >= LargePageSize ? LargePageSize : CacheLineSize);
+  if (posix_memalign(&mem, alignment, bytes) != 0)
+      mem = NULL;
+
+  entries = (TTCluster*)mem;
+
+#  if defined(MADV_HUGEPAGE)
+  if (entries && alignment == LargePageSize)
+      madvise(entries, bytes, MADV_HUGEPAGE);
+#  endif
+#endif
+}
+
+
+/// TranspositionTable::free_entries() releases the memory obtained with
+/// allocate().
+
+void TranspositionTable::free_entries() {
+
+  if (!mem)
+      return;
+
+  // A shared generation must be read before the segment is unmapped
+  detach_generation();
+  release(mem, mappedSize);
+  entries = NULL;
+  mem = NULL;
+  mappedSize = 0;
+}
+
+
+/// TranspositionTable::detach_generation() makes the table use its own
+/// generation again, starting from the current one, when the shared memory
+/// segment is going to be released.
+
+void TranspositionTable::detach_generation() {
 
-void TranspositionTable::set_size(size_t mbSize) {
+  localGeneration = uint8_t(current_generation());
+  generation = &localGeneration;
+  sharedName.clear();
+}
+
+
+/// TranspositionTable::attach_shared() backs the entries with the POSIX
+/// shared memory segment of the given name, so that all the engine processes
+/// that use the same name share one table. The first process creates the
+/// segment, zero filled, and writes the header last, the others wait for the
+/// header and check that their table has the same format and size. Entries
+/// are verified with their xor'ed key as usual, so they need no locks also
+/// across processes. The generation lives in the header, so all processes
+/// age the entries together, see new_search(). The segment survives the processes, so that a
+/// restarted engine finds the table still there: it can be removed with
+/// "rm /dev/shm/<name>" on Linux. Returns false if the table could not be
+/// attached, true otherwise and sets 'created' if the segment is new.
+
+bool TranspositionTable::attach_shared(const std::string& name, bool& created) {
+
+#if !defined(_MSC_VER)
+  std::string shmName = (name[0] == '/' ? name : "/" + name);
+  size_t len = HashFileHeaderSize + size * sizeof(TTCluster);
+  struct stat st;
+
+  int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  created = (fd != -1);
+
+  if (!created && (fd = shm_open(shmName.c_str(), O_RDWR, 0600)) == -1)
+      return false;
+
+  if (created && ftruncate(fd, off_t(len)) != 0)
+  {
+      close(fd);
+      shm_unlink(shmName.c_str());
+      return false;
+  }
+
+  // Wait a bit for the creator to size the segment
+  for (int i = 0; !created && i < 100; i++)
+  {
+      if (fstat(fd, &st) != 0 || st.st_size != 0)
+          break;
+      usleep(10000);
+  }
+
+  if (!created && (fstat(fd, &st) != 0 || size_t(st.st_size) != len))
+  {
+      close(fd);
+      return false;
+  }
 
-  size_t newSize = 1024;
+  void* segment = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (segment == MAP_FAILED)
+  {
+      if (created)
+          shm_unlink(shmName.c_str());
+      return false;
+  }
+
+  HashFileHeader* h = (HashFileHeader*)segment;
+
+  if (created)
+  {
+      // The segment is zero filled, so the entries are already clear
+      h->version = HashFileVersion;
+      h->clusterSize = sizeof(TTCluster);
+      h->clusters = size;
+      h->generation = uint8_t(current_generation());
+      h->generationTime = uint32_t(get_monotonic_time_us() / 1000000);
+      __sync_synchronize();
+      memcpy(h->magic, HashFileMagic, sizeof(h->magic));
+  }
+  else
+  {
+      // Wait a bit for the creator to write the header
+      for (int i = 0; i < 100 && memcmp((const void*)h->magic, HashFileMagic, sizeof(h->magic)); i++)
+          usleep(10000);
+
+      __sync_synchronize();
+
+      if (   memcmp((const void*)h->magic, HashFileMagic, sizeof(h->magic))
+          || h->version != HashFileVersion
+          || h->clusterSize != sizeof(TTCluster)
+          || h->clusters != size)
+      {
+          munmap(segment, len);
+          return false;
+      }
+  }
+
+  mem = segment;
+  mappedSize = len;
+  entries = (TTCluster*)((char*)mem + HashFileHeaderSize);
+  generation = &h->generation;
+  sharedName = name;
+  return true;
+#else
+  created = false;
+  return false;
+#endif
+}
+
+
+/// TranspositionTable::set_size sets the size of the transposition table,
+/// measured in megabytes. The table is reallocated also when the "Use Large
+/// Pages" option has changed. The number of clusters needs not to be a power
+/// of two, see first_entry(), so that the whole requested memory is used.
+/// The entries of the old table are moved to the new one, see migrate(), so
+/// that resizing the table or changing the "Use Large Pages" option keeps
+/// almost all the work done so far. If there is not enough memory to hold
+/// both tables the old entries are dropped instead. When the "Shared Hash
+/// Name" option is set the table is attached to the shared memory segment
+/// of that name, see attach_shared(), and an already existing table is used
+/// as it is, unless allowShared is false. If the segment cannot be attached
+/// a private table is used, and attaching is not retried until the size or
+/// the name change.
+
+void TranspositionTable::set_size(size_t mbSize, bool allowShared) {
+
+  bool newLargePages = get_option_value_bool("Use Large Pages");
+  std::string newSharedName = allowShared ? get_option_value_string("Shared Hash Name") : "";
+  bool created = false;
 
   // We store a cluster of ClusterSize number of TTEntry for each position
   // and newSize is the maximum number of storable positions.
-  while ((2 * newSize) * sizeof(TTCluster) <= (mbSize << 20))
-      newSize *= 2;
+  size_t newSize = Max((mbSize << 20) / sizeof(TTCluster), size_t(1024));
+
+  if (newSize == size && newLargePages == largePages && newSharedName == requestedSharedName)
+      return;
+
+  // Keep the old table around until its entries have been moved
+  void* oldMem = mem;
+  size_t oldMappedSize = mappedSize;
+  TTCluster* oldEntries = entries;
+  size_t oldSize = size;
+
+  size = newSize;
+  largePages = newLargePages;
+  requestedSharedName = newSharedName;
+  mem = entries = NULL;
+  detach_generation();
+
+  if (!newSharedName.empty() && !attach_shared(newSharedName, created))
+      std::cout << "info string Could not attach to shared hash " << newSharedName
+                << ", using a private one" << std::endl;
 
-  if (newSize != size)
+  if (!entries)
+      allocate(size * sizeof(TTCluster));
+
+  if (!entries && oldMem)
   {
-      size = newSize;
-      delete [] entries;
-      entries = new TTCluster[size];
-      if (!entries)
+      release(oldMem, oldMappedSize);
+      oldMem = NULL;
+      allocate(size * sizeof(TTCluster));
+  }
+
+  if (!entries)
+  {
+      std::cerr << "Failed to allocate " << mbSize
+                << " MB for transposition table." << std::endl;
+      Application::exit_with_failure();
+  }
+
+  // A private table must be cleared, a new shared segment is already zero
+  // filled and an existing one holds the work of the other processes.
+  if (sharedName.empty())
+      clear_entries();
+
+  if (oldMem && (sharedName.empty() || created))
+      migrate(oldEntries, oldSize);
+
+  if (oldMem)
+      release(oldMem, oldMappedSize);
+}
+
+
+/// TranspositionTable::migrate() moves the entries of a table of oldSize
+/// clusters to this one. Entries keep only the high bits of their key, so
+/// their new cluster cannot be computed from the key. But the index of
+/// first_entry() grows with the low 32 bits of the key, and the old cluster
+/// of an entry together with its index fraction, see index_fraction(), say
+/// in which 64th of the old cluster the key falls. That is a small range of
+/// keys, that in the new table belong all to one cluster unless the range
+/// crosses a cluster boundary. Only those entries, a few percent when the
+/// size changes by less than a factor of 2, are dropped: a copy in a wrong
+/// cluster could never be found. When a cluster is full the least valuable
+/// entry is replaced, so that shrinking keeps the newest and then the
+/// deepest entries. The new fraction of a moved entry is the one of the low
+/// end of its range, so it could be slightly wrong for the next resize.
+
+void TranspositionTable::migrate(const TTCluster* oldEntries, size_t oldSize) {
+
+  for (size_t i = 0; i < oldSize; i++)
+      for (int j = 0; j < ClusterSize; j++)
       {
-          std::cerr << "Failed to allocate " << mbSize
-                    << " MB for transposition table." << std::endl;
-          Application::exit_with_failure();
+          TTEntry e = oldEntries[i].data[j];
+
+          if (!e.key())
+              continue;
+
+          // The key falls in [pos, pos + 1) 64ths of an old cluster
+          uint64_t pos = (uint64_t(i) << 6) | ((oldEntries[i].fractions >> (6 * j)) & 0x3F);
+          uint64_t lo = pos * size / oldSize;
+          uint64_t hi = ((pos + 1) * size - 1) / oldSize;
+
+          if ((lo >> 6) != (hi >> 6))
+              continue;
+
+          TTEntry *first = entries[lo >> 6].data, *tte = first, *replace = first;
+
+          for (int k = 0; k < ClusterSize; k++, tte++)
+          {
+              if (!tte->key())
+              {
+                  replace = tte;
+                  break;
+              }
+              if (more_valuable(*replace, *tte, current_generation()))
+                  replace = tte;
+          }
+
+          if (!replace->key() || more_valuable(e, *replace, current_generation()))
+          {
+              *replace = e;
+              set_fraction(first, int(replace - first), uint32_t(lo) & 0x3F);
+          }
       }
-      clear();
-  }
 }
 
 
 /// TranspositionTable::clear overwrites the entire transposition table
-/// with zeroes. It is called whenever the table is resized, or when the
-/// user asks the program to clear the table (from the UCI interface).
-/// Perhaps we should also clear it when the "ucinewgame" command is recieved?
+/// with zeroes when the user asks the program to clear the table (from the
+/// UCI interface). Perhaps we should also clear it when the "ucinewgame"
+/// command is recieved? A shared table is left untouched, because it holds
+/// the work of all the attached processes.
 
 void TranspositionTable::clear() {
 
-  memset(entries, 0, size * sizeof(TTCluster));
+  if (!sharedName.empty())
+  {
+      std::cout << "info string Shared hash " << sharedName << " is not cleared" << std::endl;
+      return;
+  }
+
+  clear_entries();
+}
+
+
+/// TranspositionTable::clear_entries() does the work of clear(), and is also
+/// called whenever a private table is allocated. The work is split among
+/// "Threads" threads: on a big table this is much faster than a single
+/// memset and, because a freshly allocated page is placed on the NUMA node
+/// of the thread that first touches it, it also spreads the table across
+/// the nodes.
+
+void TranspositionTable::clear_entries() {
+
+  ClearTask tasks[MAX_THREADS];
+  bool launched[MAX_THREADS];
+  size_t bytes = size * sizeof(TTCluster);
+  int threads = Max(1, Min(get_option_value_int("Threads"), MAX_THREADS));
+
+  // Slices are made of whole large pages, so small tables use one thread only
+  threads = int(Min(size_t(threads), bytes / LargePageSize + 1));
+  size_t sliceLen = (bytes / threads + LargePageSize - 1) & ~(LargePageSize - 1);
+
+  if (threads == 1)
+  {
+      memset(entries, 0, bytes);
+      return;
+  }
+
+#if !defined(_MSC_VER)
+  pthread_t handles[MAX_THREADS];
+#else
+  HANDLE handles[MAX_THREADS];
+#endif
+
+  for (int i = 0; i < threads; i++)
+  {
+      size_t start = Min(bytes, i * sliceLen);
+      tasks[i].mem = (char*)entries + start;
+      tasks[i].len = Min(sliceLen, bytes - start);
+
+#if !defined(_MSC_VER)
+      launched[i] = (pthread_create(&handles[i], NULL, clear_slice, &tasks[i]) == 0);
+#else
+      launched[i] = ((handles[i] = CreateThread(NULL, 0, clear_slice, &tasks[i], 0, NULL)) != NULL);
+#endif
+
+      // If we could not launch the thread do its slice ourselves
+      if (!launched[i])
+          clear_slice(&tasks[i]);
+  }
+
+  for (int i = 0; i < threads; i++)
+      if (launched[i])
+      {
+#if !defined(_MSC_VER)
+          pthread_join(handles[i], NULL);
+#else
+          WaitForSingleObject(handles[i], INFINITE);
+          CloseHandle(handles[i]);
+#endif
+      }
 }
 
 
 /// TranspositionTable::store writes a new entry containing a position,
 /// a value, a value type, a search depth, and a best move to the
 /// transposition table. Transposition table is organized in clusters of
-/// four TTEntry objects, and when a new entry is written, it replaces
-/// the least valuable of the four entries in a cluster. A TTEntry t1 is
+/// ClusterSize TTEntry objects, and when a new entry is written, it replaces
+/// the least valuable of the entries in a cluster. A TTEntry t1 is
 /// considered to be more valuable than a TTEntry t2 if t1 is from the
 /// current search and t2 is from a previous search, or if the depth of t1
 /// is bigger than the depth of t2. A TTEntry of type VALUE_TYPE_EVAL
-/// never replaces another entry for the same position.
+/// never replaces another entry for the same position. Entries are
+/// copied before to be checked, so that all the fields we use come
+/// from the same, verified, write.
 
-void TranspositionTable::store(const Key posKey, Value v, ValueType t, Depth d, Move m, Value statV, Value kingD) {
+void TranspositionTable::store(const Key posKey, Value v, ValueType t, Depth d, Move m, Value statV, Value kingD, int threadID) {
 
   int c1, c2, c3;
-  TTEntry *tte, *replace;
-  uint32_t posKey32 = posKey >> 32; // Use the high 32 bits as key
+  TTEntry *first, *tte, *replace;
+  TTEntry snapshot;
+  TTStats& st = stats[threadID];
+  int g = current_generation();
+  uint16_t posKey16 = posKey >> 48; // Use the high 16 bits as key
+
+  st.stores++;
 
-  tte = replace = first_entry(posKey);
+  first = tte = replace = first_entry(posKey);
   for (int i = 0; i < ClusterSize; i++, tte++)
   {
-      if (!tte->key() || tte->key() == posKey32) // empty or overwrite old
+      snapshot = *tte;
+
+      if (!snapshot.key() || snapshot.key() == posKey16) // empty or overwrite old
       {
           // Preserve any exsisting ttMove
           if (m == MOVE_NONE)
-              m = tte->move();
+              m = snapshot.move();
 
-          tte->save(posKey32, v, t, d, m, generation, statV, kingD);
+          if (snapshot.key())
+              st.sameKey++;
+
+          tte->save(posKey16, v, t, d, m, g, statV, kingD);
+          set_fraction(first, i, index_fraction(posKey));
           return;
       }
 
       if (i == 0)  // replace would be a no-op in this common case
           continue;
 
-      c1 = (replace->generation() == generation ?  2 : 0);
-      c2 = (tte->generation() == generation ? -2 : 0);
+      c1 = (replace->generation() == g ?  2 : 0);
+      c2 = (tte->generation() == g ? -2 : 0);
       c3 = (tte->depth() < replace->depth() ?  1 : 0);
 
       if (c1 + c2 + c3 > 0)
           replace = tte;
   }
-  replace->save(posKey32, v, t, d, m, generation, statV, kingD);
-  overwrites++;
+  if (replace->generation() != g)
+      st.genEvictions++;
+  else
+      st.depthEvictions++;
+
+  replace->save(posKey16, v, t, d, m, g, statV, kingD);
+  set_fraction(first, int(replace - first), index_fraction(posKey));
 }
 
 
 /// TranspositionTable::retrieve looks up the current position in the
-/// transposition table. Returns a pointer to the TTEntry or NULL
-/// if position is not found.
+/// transposition table. The entry is copied in the caller supplied
+/// snapshot before to verify its key, so that a concurrent store()
+/// cannot change it under our feet. Returns a pointer to the snapshot
+/// or NULL if position is not found or the entry is torn.
 
-TTEntry* TranspositionTable::retrieve(const Key posKey) const {
+const TTEntry* TranspositionTable::retrieve(const Key posKey, TTEntry& snapshot, int threadID) const {
 
-  uint32_t posKey32 = posKey >> 32;
+  uint16_t posKey16 = posKey >> 48;
   TTEntry* tte = first_entry(posKey);
 
-  for (int i = 0; i < ClusterSize; i++, tte++)
-      if (tte->key() == posKey32)
-          return tte;
+  stats[threadID].probes++;
 
+  for (int i = 0; i < ClusterSize; i++, tte++)
+  {
+      snapshot = *tte;
+      if (snapshot.key() == posKey16)
+      {
+          stats[threadID].hits++;
+          return &snapshot;
+      }
+  }
   return NULL;
 }
 
@@ -152,12 +624,154 @@ TTEntry* TranspositionTable::retrieve(const Key posKey) const {
 /// TranspositionTable::new_search() is called at the beginning of every new
 /// search. It increments the "generation" variable, which is used to
 /// distinguish transposition table entries from previous searches from
-/// entries from the current search.
+/// entries from the current search, and resets the counters.
+///
+/// A shared generation is not owned by any of the processes, that search
+/// independently and could come and go. It is an epoch instead: it is raised
+/// only if SharedGenerationPeriod seconds have passed since the last time,
+/// by the single process that wins the compare and swap of the time in the
+/// header. Otherwise each process would age the entries of the others at
+/// every one of its own searches.
 
 void TranspositionTable::new_search() {
 
-  generation++;
-  overwrites = 0;
+#if !defined(_MSC_VER)
+  if (!sharedName.empty())
+  {
+      volatile uint32_t* lastTime = &((HashFileHeader*)mem)->generationTime;
+      uint32_t now = uint32_t(get_monotonic_time_us() / 1000000);
+      uint32_t last = *lastTime;
+
+      if (   now - last >= SharedGenerationPeriod
+          && __sync_bool_compare_and_swap(lastTime, last, now))
+          __sync_fetch_and_add(generation, 1); // Entries use only its low 4 bits
+  }
+  else
+#endif
+  *generation = uint8_t((*generation + 1) & 0xF); // Entries store only 4 bits of it
+
+  memset(stats, 0, sizeof(stats));
+}
+
+
+/// TranspositionTable::save() writes the table to a file, after a header
+/// with the format version, the size and the current generation, so that
+/// it can be reloaded with load(). Returns false on failure.
+
+bool TranspositionTable::save(const std::string& fileName) const {
+
+  HashFileHeader h;
+  char header[HashFileHeaderSize];
+
+  if (!entries)
+      return false;
+
+  memset(&h, 0, sizeof(HashFileHeader));
+  memcpy(h.magic, HashFileMagic, sizeof(h.magic));
+  h.version = HashFileVersion;
+  h.clusterSize = sizeof(TTCluster);
+  h.clusters = size;
+  h.generation = uint8_t(current_generation());
+
+  memset(header, 0, HashFileHeaderSize);
+  memcpy(header, &h, sizeof(HashFileHeader));
+
+  FILE* f = fopen(fileName.c_str(), "wb");
+  if (!f)
+      return false;
+
+  bool ok =   fwrite(header, HashFileHeaderSize, 1, f) == 1
+           && fwrite(entries, sizeof(TTCluster), size, f) == size;
+
+  return fclose(f) == 0 && ok;
+}
+
+
+/// TranspositionTable::load() reloads a table written by save(). The file
+/// must have the current format version and the same number of clusters of
+/// the table, as set by the "Hash" option. On POSIX systems the file is
+/// mapped in memory, private copy on write, so that even a table of many
+/// GB is available at once and its pages are read from disk only when
+/// touched. A shared table is instead read from the file into its segment.
+/// The saved generation is restored so that new_search() keeps ageing the
+/// loaded entries as if the search had never stopped. Returns false on
+/// failure, leaving a private table untouched or cleared if it was partially
+/// read. A partially read shared table keeps what has been read, because
+/// the other processes could be using it.
+
+bool TranspositionTable::load(const std::string& fileName) {
+
+  HashFileHeader h;
+
+  if (!entries)
+      return false;
+
+#if !defined(_MSC_VER)
+  // A shared table must stay in its segment, so the file is read into it
+  if (sharedName.empty())
+  {
+      size_t fileSize = HashFileHeaderSize + size * sizeof(TTCluster);
+      struct stat st;
+      int fd = open(fileName.c_str(), O_RDONLY);
+      if (fd == -1)
+          return false;
+
+      if (   fstat(fd, &st) != 0
+          || size_t(st.st_size) != fileSize
+          || read(fd, &h, sizeof(HashFileHeader)) != ssize_t(sizeof(HashFileHeader))
+          || memcmp(h.magic, HashFileMagic, sizeof(h.magic))
+          || h.version != HashFileVersion
+          || h.clusterSize != sizeof(TTCluster)
+          || h.clusters != size)
+      {
+          close(fd);
+          return false;
+      }
+
+      void* fileMem = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      close(fd); // The mapping stays valid after closing the file
+
+      if (fileMem == MAP_FAILED)
+          return false;
+
+#  if defined(MADV_WILLNEED)
+      madvise(fileMem, fileSize, MADV_WILLNEED); // Start reading ahead in background
+#  endif
+
+      // The table keeps its "Use Large Pages" setting, otherwise set_size()
+      // would discard the loaded entries at the next search.
+      free_entries();
+      mem = fileMem;
+      mappedSize = fileSize;
+      entries = (TTCluster*)((char*)mem + HashFileHeaderSize);
+
+      *generation = uint8_t(h.generation & 0xF);
+      return true;
+  }
+#endif
+
+  FILE* f = fopen(fileName.c_str(), "rb");
+  if (!f)
+      return false;
+
+  bool ok =   fread(&h, sizeof(HashFileHeader), 1, f) == 1
+           && !memcmp(h.magic, HashFileMagic, sizeof(h.magic))
+           && h.version == HashFileVersion
+           && h.clusterSize == sizeof(TTCluster)
+           && h.clusters == size
+           && fseek(f, long(HashFileHeaderSize), SEEK_SET) == 0
+           && fread(entries, sizeof(TTCluster), size, f) == size;
+
+  fclose(f);
+  if (!ok)
+  {
+      if (sharedName.empty())
+          clear_entries(); // The entries could have been partially read
+      return false;
+  }
+
+  *generation = uint8_t(h.generation & 0xF);
+  return true;
 }
 
 
@@ -173,9 +787,10 @@ void TranspositionTable::insert_pv(const Position& pos, Move pv[]) {
 
   for (int i = 0; pv[i] != MOVE_NONE; i++)
   {
-      TTEntry *tte = retrieve(p.get_key());
+      TTEntry snapshot;
+      const TTEntry* tte = retrieve(p.get_key(), snapshot, pos.thread());
       if (!tte || tte->move() != pv[i])
-          store(p.get_key(), VALUE_NONE, VALUE_TYPE_NONE, Depth(-127*OnePly), pv[i], VALUE_NONE, VALUE_NONE);
+          store(p.get_key(), VALUE_NONE, VALUE_TYPE_NONE, Depth(-127*OnePly), pv[i], VALUE_NONE, VALUE_NONE, pos.thread());
       p.do_move(pv[i], st);
   }
 }
@@ -190,6 +805,7 @@ void TranspositionTable::insert_pv(const Position& pos, Move pv[]) {
 void TranspositionTable::extract_pv(const Position& pos, Move bestMove, Move pv[], const int PLY_MAX) {
 
   const TTEntry* tte;
+  TTEntry snapshot;
   StateInfo st;
   Position p(pos, pos.thread());
   int ply = 0;
@@ -201,7 +817,7 @@ void TranspositionTable::extract_pv(const Position& pos, Move bestMove, Move pv[
 
   // Extract moves from TT when possible. We try hard to always
   // get a ponder move, that's the reason of ply < 2 conditions.
-  while (   (tte = retrieve(p.get_key())) != NULL
+  while (   (tte = retrieve(p.get_key(), snapshot, pos.thread())) != NULL
          && tte->move() != MOVE_NONE
          && (tte->type() == VALUE_TYPE_EXACT || ply < 2)
          && move_is_legal(p, tte->move())
@@ -221,6 +837,48 @@ void TranspositionTable::extract_pv(const Position& pos, Move bestMove, Move pv[
 
 int TranspositionTable::full() const {
 
+  TTStats st = get_stats();
   double N = double(size) * ClusterSize;
+  double overwrites = double(st.genEvictions + st.depthEvictions);
   return int(1000 * (1 - exp(overwrites * log(1.0 - 1.0/N))));
 }
+
+
+/// TranspositionTable::get_stats() returns the sum of the counters of all
+/// the threads for the current search.
+
+TTStats TranspositionTable::get_stats() const {
+
+  TTStats sum;
+  memset(&sum, 0, sizeof(TTStats));
+
+  for (int i = 0; i < MAX_THREADS; i++)
+  {
+      sum.probes         += stats[i].probes;
+      sum.hits           += stats[i].hits;
+      sum.unusable       += stats[i].unusable;
+      sum.stores         += stats[i].stores;
+      sum.sameKey        += stats[i].sameKey;
+      sum.genEvictions   += stats[i].genEvictions;
+      sum.depthEvictions += stats[i].depthEvictions;
+  }
+  return sum;
+}
+
+
+/// TranspositionTable::depth_histogram() counts the entries in the table
+/// by depth, in TTHistogramSize bins, see tt.h. It scans the whole table,
+/// so it is meant to be called between searches and not while searching.
+
+void TranspositionTable::depth_histogram(uint64_t hist[]) const {
+
+  memset(hist, 0, TTHistogramSize * sizeof(uint64_t));
+
+  for (size_t i = 0; i < size; i++)
+      for (int j = 0; j < ClusterSize; j++)
+      {
+          const TTEntry& e = entries[i].data[j];
+          if (e.key())
+              hist[Max(0, Min(e.depth() / OnePly, TTHistogramSize - 1))]++;
+      }
+}
@@ -25,8 +25,12 @@
 //// Includes
 ////
 
+#include <cassert>
+#include <string>
+
 #include "depth.h"
 #include "position.h"
+#include "thread.h"
 #include "value.h"
 
 
@@ -38,62 +42,98 @@
 ///
 /// A TTEntry needs 96 bits to be stored
 ///
-/// bit  0-31: key
-/// bit 32-63: data
-/// bit 64-79: value
-/// bit 80-95: depth
+/// bit  0-15: key, xor'ed with the other 80 bits
+/// bit 16-31: value
+/// bit 32-47: static value
+/// bit 48-63: king danger
+/// bit 64-95: data
 ///
 /// the 32 bits of the data field are so defined
 ///
 /// bit  0-16: move
-/// bit 17-19: not used
-/// bit 20-22: value type
-/// bit 23-31: generation
+/// bit 17-18: value type
+/// bit 19-22: generation
+/// bit 23-31: depth, signed
+///
+/// The entry is written and read without locks by many threads, so a reader
+/// could see a mix of two different writes. Because the stored key is xor'ed
+/// with all the other fields, such a torn entry does not match its position
+/// key anymore and is seen as an empty slot.
 
 class TTEntry {
 
 public:
-  void save(uint32_t k, Value v, ValueType t, Depth d, Move m, int g, Value statV, Value kd) {
+  void save(uint16_t k, Value v, ValueType t, Depth d, Move m, int g, Value statV, Value kd) {
+
+      assert(d >= -256 && d < 256);
 
-      key32 = k;
-      data = (m & 0x1FFFF) | (t << 20) | (g << 23);
+      data = (m & 0x1FFFF) | (t << 17) | ((g & 0xF) << 19) | (uint32_t(d) << 23);
       value16     = int16_t(v);
-      depth16     = int16_t(d);
       staticValue = int16_t(statV);
       kingDanger  = int16_t(kd);
+      key16 = k ^ check();
   }
 
-  uint32_t key() const { return key32; }
-  Depth depth() const { return Depth(depth16); }
+  uint16_t key() const { return key16 ^ check(); }
+  Depth depth() const { return Depth(int32_t(data) >> 23); }
   Move move() const { return Move(data & 0x1FFFF); }
   Value value() const { return Value(value16); }
-  ValueType type() const { return ValueType((data >> 20) & 7); }
-  int generation() const { return data >> 23; }
+  ValueType type() const { return ValueType((data >> 17) & 3); }
+  int generation() const { return (data >> 19) & 0xF; }
   Value static_value() const { return Value(staticValue); }
   Value king_danger() const { return Value(kingDanger); }
 
 private:
-  uint32_t key32;
-  uint32_t data;
+  uint16_t check() const {
+
+      return uint16_t(data ^ (data >> 16) ^ uint16_t(value16) ^ uint16_t(staticValue) ^ uint16_t(kingDanger));
+  }
+
+  uint16_t key16;
   int16_t value16;
-  int16_t depth16;
   int16_t staticValue;
   int16_t kingDanger;
+  uint32_t data;
 };
 
 
 /// This is the number of TTEntry slots for each position
-const int ClusterSize = 4;
+const int ClusterSize = 5;
 
 /// Each group of ClusterSize number of TTEntry form a TTCluster
 /// that is indexed by a single position key. TTCluster size must
 ///  be not bigger then a cache line size, in case it is less then
-/// it should be padded to guarantee always aligned accesses.
+/// it should be padded to guarantee always aligned accesses. The
+/// 4 bytes left after the entries hold 6 more bits of the index of
+/// each entry, see TranspositionTable::index_fraction().
 
 struct TTCluster {
   TTEntry data[ClusterSize];
+  uint32_t fractions;
+};
+
+
+/// TTStats holds the transposition table counters of a single thread for
+/// the current search. Every thread updates only its own copy, padded to two
+/// cache lines so that, however the table is aligned, the counters of two
+/// threads never share a cache line.
+
+struct TTStats {
+  uint64_t probes;          // calls to retrieve()
+  uint64_t hits;            // entries found with a verified key
+  uint64_t unusable;        // hits that could not be used to cut off
+  uint64_t stores;          // calls to store()
+  uint64_t sameKey;         // stores over an entry of the same position
+  uint64_t genEvictions;    // stores over an entry of a previous search
+  uint64_t depthEvictions;  // stores over a shallower entry of this search
+  char pad[128 - 7 * sizeof(uint64_t)];
 };
 
+/// Resident entries are grouped by depth in plies: bin 0 for the entries of
+/// less than one ply, like the quiescence and static evaluation ones, then
+/// one bin per ply and the last one for all the deeper entries.
+const int TTHistogramSize = 24;
+
 
 /// The transposition table class. This is basically just a huge array
 /// containing TTEntry objects, and a few methods for writing new entries
@@ -104,26 +144,47 @@ class TranspositionTable {
 public:
   TranspositionTable();
   ~TranspositionTable();
-  void set_size(size_t mbSize);
+  void set_size(size_t mbSize, bool allowShared = true);
   void clear();
-  void store(const Key posKey, Value v, ValueType type, Depth d, Move m, Value statV, Value kingD);
-  TTEntry* retrieve(const Key posKey) const;
+  void store(const Key posKey, Value v, ValueType type, Depth d, Move m, Value statV, Value kingD, int threadID);
+  const TTEntry* retrieve(const Key posKey, TTEntry& snapshot, int threadID) const;
+  void unusable_hit(int threadID) { stats[threadID].unusable++; }
   void new_search();
   void insert_pv(const Position& pos, Move pv[]);
   void extract_pv(const Position& pos, Move bestMove, Move pv[], const int PLY_MAX);
   int full() const;
+  TTStats get_stats() const;
+  void depth_histogram(uint64_t hist[]) const;
+  bool save(const std::string& fileName) const;
+  bool load(const std::string& fileName);
   TTEntry* first_entry(const Key posKey) const;
 
 private:
-  // Be sure 'overwrites' is at least one cache line away
+  // Be sure counters are at least one cache line away
   // from read only variables.
-  unsigned char pad_before[64 - sizeof(unsigned)];
-  unsigned overwrites; // heavy SMP read/write access here
+  unsigned char pad_before[64];
+  mutable TTStats stats[MAX_THREADS]; // heavy SMP read/write access here
   unsigned char pad_after[64];
 
+  void allocate(size_t bytes);
+  void free_entries();
+  void clear_entries();
+  void migrate(const TTCluster* oldEntries, size_t oldSize);
+  uint32_t index_fraction(const Key posKey) const;
+  void set_fraction(TTEntry* first, int i, uint32_t fraction);
+  bool attach_shared(const std::string& name, bool& created);
+  void detach_generation();
+  int current_generation() const { return *generation & 0xF; }
+
   size_t size;
+  void* mem;         // Start of the allocated memory, entries could follow a file header
+  size_t mappedSize; // Not zero if entries have been obtained with mmap()
+  bool largePages;
   TTCluster* entries;
-  uint8_t generation;
+  std::string sharedName;        // Not empty if entries are in a shared memory segment
+  std::string requestedSharedName; // "Shared Hash Name" at last set_size(), also if not attached
+  volatile uint8_t* generation;  // Points to localGeneration or to the shared one
+  uint8_t localGeneration;
 };
 
 extern TranspositionTable TT;
@@ -131,11 +192,34 @@ extern TranspositionTable TT;
 
 /// TranspositionTable::first_entry returns a pointer to the first
 /// entry of a cluster given a position. The low 32 bits of the key
-/// are used to get the index in the table.
+/// are used to get the index in the table: they are seen as a fixed
+/// point fraction in [0, 1) and multiplied by the number of clusters,
+/// so that any table size can be used without a modulo.
 
 inline TTEntry* TranspositionTable::first_entry(const Key posKey) const {
 
-  return entries[uint32_t(posKey) & (size - 1)].data;
+  return entries[(uint64_t(uint32_t(posKey)) * size) >> 32].data;
+}
+
+
+/// TranspositionTable::index_fraction() returns the 6 bits that follow the
+/// cluster index in the same product, that is in which 64th of its cluster
+/// the key falls. Entries keep them in their cluster, so that migrate() can
+/// find the cluster of an entry in a table of another size.
+
+inline uint32_t TranspositionTable::index_fraction(const Key posKey) const {
+
+  return uint32_t((uint64_t(uint32_t(posKey)) * size) >> 26) & 0x3F;
+}
+
+
+/// TranspositionTable::set_fraction() stores the index fraction of the i-th
+/// entry of the cluster starting at first.
+
+inline void TranspositionTable::set_fraction(TTEntry* first, int i, uint32_t fraction) {
+
+  uint32_t& f = ((TTCluster*)first)->fractions;
+  f = (f & ~(0x3Fu << (6 * i))) | (fraction << (6 * i));
 }
 
 #endif // !defined(TT_H_INCLUDED)
@@ -66,6 +66,21 @@ typedef uint64_t Bitboard;
 //// -DUSE_POPCNT   | Add runtime support for use of popcnt asm-instruction.
 ////                | Works only in 64-bit mode. For compiling requires hardware
 ////                | with popcnt support. Around 4% speed-up.
+////
+//// -DUSE_BMI2     | Add runtime support for use of pext asm-instruction to look
+////                | up slider attacks. Works only in 64-bit mode.
+////
+//// -DUSE_AVX2     | Add runtime support for AVX2 kernels counting mobility and
+////                | king attacks of all the pieces of a side at once. Compiler
+////                | must know AVX2 intrinsics, hardware does not need them.
+////
+//// -DUSE_ATTACK_MAPS | Keep the squares attacked by each side and piece type
+////                | updated in Position at each move. Legality tests and SEE
+////                | read them instead of computing the attackers of a square.
+////
+//// USE_POPCNT, USE_BMI2 and USE_AVX2 only compile in the extra code paths,
+//// the one to run is chosen at startup with cpuid. So a single executable
+//// built with all of them still runs on CPUs missing those instructions.
 
 // Automatic detection for 64-bit under Windows
 #if defined(_WIN64)
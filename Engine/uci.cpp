@@ -27,6 +27,7 @@
 #include <sstream>
 #include <string>
 
+#include "benchmark.h"
 #include "book.h"
 #include "evaluate.h"
 #include "misc.h"
@@ -35,6 +36,7 @@
 #include "position.h"
 #include "san.h"
 #include "search.h"
+#include "tt.h"
 #include "uci.h"
 #include "ucioption.h"
 
@@ -60,7 +62,10 @@ namespace {
   void set_option(UCIInputParser& uip);
   void set_position(UCIInputParser& uip);
   bool go(UCIInputParser& uip);
-  void perft(UCIInputParser& uip);
+  void perft(UCIInputParser& uip, bool divide);
+  void hash_file(UCIInputParser& uip, bool save);
+  void hash_stats();
+  void analyse(UCIInputParser& uip);
 }
 
 
@@ -72,19 +77,21 @@ namespace {
 /// called immediately after the program has finished initializing.
 /// The program remains in this loop until it receives the "quit" UCI
 /// command. It waits for a command from the user, and passes this
-/// command to handle_command and also intercepts EOF from stdin,
-/// by translating EOF to the "quit" command. This ensures that Stockfish
-/// exits gracefully if the GUI dies unexpectedly.
+/// command to handle_command. Input is read by the input thread, see
+/// start_input_thread(), that also translates EOF from stdin to the "quit"
+/// command. This ensures that Stockfish exits gracefully if the GUI dies
+/// unexpectedly.
 
 void uci_main_loop() {
 
   RootPosition.from_fen(StartPosition);
   string command;
 
+  start_input_thread();
+
   do {
       // Wait for a command from stdin
-      if (!getline(cin, command))
-          command = "quit";
+      command = read_input();
 
   } while (handle_command(command));
 }
@@ -128,6 +135,18 @@ bool handle_command(const string& command) {
       set_position(uip);
   else if (token == "setoption")
       set_option(uip);
+  else if (token == "savehash")
+      hash_file(uip, true);
+  else if (token == "loadhash")
+      hash_file(uip, false);
+  else if (token == "hashstats")
+      hash_stats();
+  else if (token == "analyse")
+      analyse(uip);
+  else if (token == "perft")
+      perft(uip, false);
+  else if (token == "divide")
+      perft(uip, true);
 
   return true;
 }
@@ -219,6 +238,85 @@ namespace {
   }
 
 
+  // hash_file() is called when Stockfish receives the "savehash" or the
+  // "loadhash" command, followed by a file name. The transposition table is
+  // sized after the "Hash" option first, so that a table can be loaded
+  // before any search, and only a file saved with the same "Hash" value
+  // can be loaded back.
+
+  void hash_file(UCIInputParser& uip, bool save) {
+
+    string fileName;
+
+    getline(uip >> ws, fileName);
+    if (fileName.empty())
+    {
+        cout << "info string Missing file name" << endl;
+        return;
+    }
+
+    TT.set_size(get_option_value_int("Hash"));
+
+    if (save ? TT.save(fileName) : TT.load(fileName))
+        cout << "info string Hash " << (save ? "saved to " : "loaded from ") << fileName << endl;
+    else
+        cout << "info string Could not " << (save ? "save hash to " : "load hash from ") << fileName << endl;
+  }
+
+
+  // hash_stats() is called when Stockfish receives the "hashstats" command.
+  // It prints the transposition table counters of the last search and the
+  // number of entries in the table for each depth, in plies.
+
+  void hash_stats() {
+
+    TTStats st = TT.get_stats();
+    uint64_t hist[TTHistogramSize];
+
+    cout << "info string hash probes " << st.probes
+         << " hits " << st.hits
+         << " unusable " << st.unusable
+         << " stores " << st.stores
+         << " samekey " << st.sameKey
+         << " evictions generation " << st.genEvictions
+         << " depth " << st.depthEvictions << endl;
+
+    TT.depth_histogram(hist);
+
+    cout << "info string hash depths";
+    for (int i = 0; i < TTHistogramSize; i++)
+        cout << ' ' << (i == TTHistogramSize - 1 ? ">=" : "") << i << ':' << hist[i];
+    cout << endl;
+  }
+
+
+  // analyse() is called when Stockfish receives the "analyse" command,
+  // followed by an input and an output file name and optionally by
+  // "depth" and "workers" and their values. The positions of the input
+  // file are searched concurrently, see analyse_positions().
+
+  void analyse(UCIInputParser& uip) {
+
+    string inputFile, outputFile, token;
+    int depth = 10, workers = cpu_count();
+
+    if (!(uip >> inputFile >> outputFile))
+    {
+        cout << "info string Missing file name" << endl;
+        return;
+    }
+
+    while (uip >> token)
+        if (token == "depth")
+            uip >> depth;
+        else if (token == "workers")
+            uip >> workers;
+
+    if (analyse_positions(inputFile, outputFile, depth, workers))
+        cout << "info string Analysis written to " << outputFile << endl;
+  }
+
+
   // go() is called when Stockfish receives the "go" UCI command. The
   // input parameter is a UCIInputParser. It is assumed that this
   // parser has consumed the first token of the UCI command ("go"),
@@ -277,10 +375,16 @@ namespace {
                  time, inc, movesToGo, depth, nodes, moveTime, searchMoves);
   }
 
-  void perft(UCIInputParser& uip) {
+  // perft() is called when Stockfish receives the "perft" or the "divide"
+  // command, followed by a depth. It counts the leaf nodes of the tree of
+  // that depth from the current position, with "divide" for each root move
+  // too, see perft() in search.cpp.
+
+  void perft(UCIInputParser& uip, bool divide) {
 
     string token;
-    int depth, tm, n;
+    int depth, tm;
+    int64_t n;
     Position pos(RootPosition, RootPosition.thread());
 
     if (!(uip >> depth))
@@ -288,11 +392,11 @@ namespace {
 
     tm = get_system_time();
 
-    n = perft(pos, depth * OnePly);
+    n = perft(pos, depth * OnePly, divide);
 
     tm = get_system_time() - tm;
     std::cout << "\nNodes " << n
               << "\nTime (ms) " << tm
-              << "\nNodes/second " << (int)(n/(tm/1000.0)) << std::endl;
+              << "\nNodes/second " << n * 1000 / Max(tm, 1) << std::endl;
   }
 }
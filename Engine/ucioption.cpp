@@ -113,9 +113,19 @@ namespace {
     o["Pawn Endgame Extension (non-PV nodes)"] = Option(2, 0, 2);
     o["Randomness"] = Option(0, 0, 10);
     o["Minimum Split Depth"] = Option(4, 4, 7);
-    o["Maximum Number of Threads per Split Point"] = Option(5, 4, 8);
+    o["Maximum Number of Threads per Split Point"] = Option(5, 4, MAX_THREADS);
     o["Threads"] = Option(1, 1, MAX_THREADS);
+    o["Bind Threads"] = Option(false);
+
+    o["SMP Mode"] = Option("YBWC", COMBO);
+    o["SMP Mode"].comboValues.push_back("YBWC");
+    o["SMP Mode"].comboValues.push_back("Lazy SMP");
+    o["Parallel MultiPV"] = Option(false);
     o["Hash"] = Option(32, 4, 8192);
+    o["Eval Cache"] = Option(1, 0, 256);
+    o["Lazy Evaluation"] = Option(false);
+    o["Use Large Pages"] = Option(false);
+    o["Shared Hash Name"] = Option("");
     o["Clear Hash"] = Option(false, BUTTON);
     o["New Game"] = Option(false, BUTTON);
     o["Ponder"] = Option(true);
@@ -186,7 +196,9 @@ namespace {
 
 /// init_uci_options() initializes the UCI options.  Currently, the only
 /// thing this function does is to initialize the default value of the
-/// "Threads" parameter to the number of available CPU cores.
+/// "Minimum Split Depth" parameter according to the number of CPU cores.
+/// "Threads" stays at 1 by default: all the cores would be a bad surprise
+/// on a shared machine or on a phone, the GUI can ask for more.
 
 void init_uci_options() {
 
@@ -194,14 +206,10 @@ void init_uci_options() {
 
   // Set optimal value for parameter "Minimum Split Depth"
   // according to number of available cores.
-  assert(options.find("Threads") != options.end());
   assert(options.find("Minimum Split Depth") != options.end());
 
-  Option& thr = options["Threads"];
   Option& msd = options["Minimum Split Depth"];
 
-  thr.defaultValue = thr.currentValue = stringify(cpu_count());
-
   if (cpu_count() >= 8)
       msd.defaultValue = msd.currentValue = stringify(7);
 }